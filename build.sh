@@ -1,9 +1,16 @@
 #!/bin/sh -e
 
-dependencies="glm glew sdl2 openvr x11 xcomposite xfixes mpv libxdo"
-includes=$(pkg-config --cflags $dependencies)
-libs="$(pkg-config --libs $dependencies) -lm -pthread"
+dependencies="glm glew sdl2 openvr x11 xcomposite xfixes xdamage libxdo"
+# libmpv is loaded at runtime with dlopen, only its headers are needed to build
+includes="$(pkg-config --cflags $dependencies) $(pkg-config --cflags mpv)"
+libs="$(pkg-config --libs $dependencies) -lm -ldl -pthread"
 gcc -c src/window_texture.c -O2 -DNDEBUG $includes
 g++ -c src/mpv.cpp -O2 -DNDEBUG $includes
+g++ -c src/shader_cache.cpp -O2 -DNDEBUG $includes
+g++ -c src/state_writer.cpp -O2 -DNDEBUG $includes
+g++ -c src/placement_profiles.cpp -O2 -DNDEBUG $includes
+g++ -c src/control_socket.cpp -O2 -DNDEBUG $includes
+g++ -c src/dynamic_resolution.cpp -O2 -DNDEBUG $includes
+g++ -c src/gl_state.cpp -O2 -DNDEBUG $includes
 g++ -c src/main.cpp -O2 -DNDEBUG $includes
-g++ -o vr-video-player -O2 window_texture.o mpv.o main.o -s $libs
+g++ -o vr-video-player -O2 window_texture.o mpv.o shader_cache.o state_writer.o placement_profiles.o control_socket.o dynamic_resolution.o gl_state.o main.o -s $libs
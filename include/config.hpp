@@ -1,8 +1,13 @@
 #pragma once
 
 #include <string>
+#include <algorithm>
 #include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <locale.h>
 #include <limits.h>
 #include <unistd.h>
 #include <libgen.h>
@@ -36,11 +41,19 @@ struct PlaneConfig {
     float zoom = 0.0f;
 };
 
+struct EquirectConfig {
+    glm::vec3 position = glm::vec3(0.0f, 0.0f, 0.0f);
+    glm::quat rotation = glm::quat(0.0f, 0.0f, 0.0f, 0.0f);
+    float zoom = 0.0f;
+};
+
 struct Config {
     SphereConfig sphere;
     Sphere360Config sphere360;
     FlatConfig flat;
     PlaneConfig plane;
+    EquirectConfig equirect180;
+    EquirectConfig equirect360;
 };
 
 static std::string get_home_dir() {
@@ -70,6 +83,10 @@ static std::string get_config_dir() {
     return config_dir;
 }
 
+static std::string get_config_path() {
+    return get_config_dir() + "/config";
+}
+
 static int create_directory_recursive(char *path) {
     int path_len = strlen(path);
     char *p = path;
@@ -209,7 +226,7 @@ static Config read_config(bool &exists) {
 
     Config config;
 
-    const std::string config_path = get_config_dir() + "/config";
+    const std::string config_path = get_config_path();
     std::string file_content;
     if(!file_get_content(config_path.c_str(), file_content)) {
         fprintf(stderr, "Warning: Failed to read config file: %s\n", config_path.c_str());
@@ -248,6 +265,18 @@ static Config read_config(bool &exists) {
             string_to_quat(std::string(value.str, value.size), config.plane.rotation, key);
         } else if(key == "plane.zoom") {
             string_to_float(std::string(value.str, value.size), config.plane.zoom, key);
+        } else if(key == "equirect180.position") {
+            string_to_vec3(std::string(value.str, value.size), config.equirect180.position, key);
+        } else if(key == "equirect180.rotation") {
+            string_to_quat(std::string(value.str, value.size), config.equirect180.rotation, key);
+        } else if(key == "equirect180.zoom") {
+            string_to_float(std::string(value.str, value.size), config.equirect180.zoom, key);
+        } else if(key == "equirect360.position") {
+            string_to_vec3(std::string(value.str, value.size), config.equirect360.position, key);
+        } else if(key == "equirect360.rotation") {
+            string_to_quat(std::string(value.str, value.size), config.equirect360.rotation, key);
+        } else if(key == "equirect360.zoom") {
+            string_to_float(std::string(value.str, value.size), config.equirect360.zoom, key);
         } else {
             fprintf(stderr, "Warning: Invalid config option: %.*s\n", (int)line.size, line.str);
         }
@@ -259,41 +288,43 @@ static Config read_config(bool &exists) {
     return config;
 }
 
-static void save_config(const Config &config) {
-    setlocale(LC_ALL, "C");
-
-    const std::string config_path = get_config_dir() + "/config";
-
-    char dir_tmp[PATH_MAX];
-    strcpy(dir_tmp, config_path.c_str());
-    char *dir = dirname(dir_tmp);
+static void string_append_format(std::string &str, const char *fmt, ...) {
+    char buffer[512];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    if(len > 0)
+        str.append(buffer, std::min((size_t)len, sizeof(buffer) - 1));
+}
 
-    if(create_directory_recursive(dir) != 0) {
-        fprintf(stderr, "Warning: Failed to create config directory: %s\n", dir);
-        return;
-    }
+// The content of the config file for |config|, see StateWriter for how it's saved
+static std::string config_to_string(const Config &config) {
+    setlocale(LC_ALL, "C");
 
-    FILE *file = fopen(config_path.c_str(), "wb");
-    if(!file) {
-        fprintf(stderr, "Warning: Failed to create config file: %s\n", config_path.c_str());
-        return;
-    }
+    std::string content;
+    string_append_format(content, "sphere.position %f|%f|%f\n", config.sphere.position.x, config.sphere.position.y, config.sphere.position.z);
+    string_append_format(content, "sphere.rotation %f|%f|%f|%f\n", config.sphere.rotation.x, config.sphere.rotation.y, config.sphere.rotation.z, config.sphere.rotation.w);
+    string_append_format(content, "sphere.zoom %f\n", config.sphere.zoom);
 
-    fprintf(file, "sphere.position %f|%f|%f\n", config.sphere.position.x, config.sphere.position.y, config.sphere.position.z);
-    fprintf(file, "sphere.rotation %f|%f|%f|%f\n", config.sphere.rotation.x, config.sphere.rotation.y, config.sphere.rotation.z, config.sphere.rotation.w);
-    fprintf(file, "sphere.zoom %f\n", config.sphere.zoom);
+    string_append_format(content, "sphere360.position %f|%f|%f\n", config.sphere360.position.x, config.sphere360.position.y, config.sphere360.position.z);
+    string_append_format(content, "sphere360.rotation %f|%f|%f|%f\n", config.sphere360.rotation.x, config.sphere360.rotation.y, config.sphere360.rotation.z, config.sphere360.rotation.w);
+    string_append_format(content, "sphere360.zoom %f\n", config.sphere360.zoom);
 
-    fprintf(file, "sphere360.position %f|%f|%f\n", config.sphere360.position.x, config.sphere360.position.y, config.sphere360.position.z);
-    fprintf(file, "sphere360.rotation %f|%f|%f|%f\n", config.sphere360.rotation.x, config.sphere360.rotation.y, config.sphere360.rotation.z, config.sphere360.rotation.w);
-    fprintf(file, "sphere360.zoom %f\n", config.sphere360.zoom);
+    string_append_format(content, "flat.position %f|%f|%f\n", config.flat.position.x, config.flat.position.y, config.flat.position.z);
+    string_append_format(content, "flat.rotation %f|%f|%f|%f\n", config.flat.rotation.x, config.flat.rotation.y, config.flat.rotation.z, config.flat.rotation.w);
+    string_append_format(content, "flat.zoom %f\n", config.flat.zoom);
 
-    fprintf(file, "flat.position %f|%f|%f\n", config.flat.position.x, config.flat.position.y, config.flat.position.z);
-    fprintf(file, "flat.rotation %f|%f|%f|%f\n", config.flat.rotation.x, config.flat.rotation.y, config.flat.rotation.z, config.flat.rotation.w);
-    fprintf(file, "flat.zoom %f\n", config.flat.zoom);
+    string_append_format(content, "plane.position %f|%f|%f\n", config.plane.position.x, config.plane.position.y, config.plane.position.z);
+    string_append_format(content, "plane.rotation %f|%f|%f|%f\n", config.plane.rotation.x, config.plane.rotation.y, config.plane.rotation.z, config.plane.rotation.w);
+    string_append_format(content, "plane.zoom %f\n", config.plane.zoom);
 
-    fprintf(file, "plane.position %f|%f|%f\n", config.plane.position.x, config.plane.position.y, config.plane.position.z);
-    fprintf(file, "plane.rotation %f|%f|%f|%f\n", config.plane.rotation.x, config.plane.rotation.y, config.plane.rotation.z, config.plane.rotation.w);
-    fprintf(file, "plane.zoom %f\n", config.plane.zoom);
+    string_append_format(content, "equirect180.position %f|%f|%f\n", config.equirect180.position.x, config.equirect180.position.y, config.equirect180.position.z);
+    string_append_format(content, "equirect180.rotation %f|%f|%f|%f\n", config.equirect180.rotation.x, config.equirect180.rotation.y, config.equirect180.rotation.z, config.equirect180.rotation.w);
+    string_append_format(content, "equirect180.zoom %f\n", config.equirect180.zoom);
 
-    fclose(file);
-}
\ No newline at end of file
+    string_append_format(content, "equirect360.position %f|%f|%f\n", config.equirect360.position.x, config.equirect360.position.y, config.equirect360.position.z);
+    string_append_format(content, "equirect360.rotation %f|%f|%f|%f\n", config.equirect360.rotation.x, config.equirect360.rotation.y, config.equirect360.rotation.z, config.equirect360.rotation.w);
+    string_append_format(content, "equirect360.zoom %f\n", config.equirect360.zoom);
+    return content;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+struct ControlCommand {
+    // Connection the command came from, the reply is sent back to it
+    uint32_t client_id;
+    std::string line;
+};
+
+// Unix domain socket that other programs can send commands to, one command per line.
+// Connections are accepted and read on a background thread. Received commands are queued for the main loop, which only has to check
+// an atomic flag to see that there are none, and replies are written back on the background thread so the main loop never waits on a client.
+class ControlSocket {
+public:
+    ControlSocket() = default;
+    ~ControlSocket();
+    ControlSocket(const ControlSocket&) = delete;
+    ControlSocket& operator=(const ControlSocket&) = delete;
+
+    // Creates the socket at |path|, replacing an old one, and starts the thread that serves it.
+    // |wakeup_event| is pushed as an sdl event whenever commands are queued, so that a main loop waiting on sdl events wakes up
+    bool start(const std::string &path, uint32_t wakeup_event);
+    // Closes all connections and removes the socket
+    void stop();
+
+    bool has_commands() const { return commands_pending.load(std::memory_order_acquire); }
+    // Moves the commands received since the last call into |commands|
+    void take_commands(std::vector<ControlCommand> &commands);
+    // Queues |reply| to be sent to the connection |client_id|. A newline is added
+    void reply(uint32_t client_id, std::string reply);
+private:
+    struct Client {
+        uint32_t id;
+        int fd;
+        std::string input;
+        std::string output;
+        // Commands that haven't been replied to yet. A client that closed its end still gets the replies to the commands it sent
+        int pending_replies;
+        bool input_closed;
+    };
+
+    void thread_loop();
+    void wakeup_thread();
+    bool read_client(Client &client);
+    bool write_client(Client &client);
+
+    std::string path;
+    int listen_fd = -1;
+    // Written to by other threads to wake up the thread from poll
+    int wakeup_pipe[2] = { -1, -1 };
+    uint32_t wakeup_event = (uint32_t)-1;
+    std::thread thread;
+    std::atomic<bool> running{ false };
+
+    std::mutex mutex;
+    std::vector<ControlCommand> commands;
+    std::vector<ControlCommand> replies;
+    std::atomic<bool> commands_pending{ false };
+};
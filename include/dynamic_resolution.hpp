@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+#define DYNAMIC_RESOLUTION_QUERIES 4
+
+// Picks the scale the eyes are rendered at from the gpu time of recent frames, so that frames finish within the display's frame time
+// instead of the compositor falling back to reprojection. The scale is lowered as soon as frames get too slow and only raised after a longer
+// time with enough headroom, and there is a gap between the two thresholds so that it doesn't alternate between two scales.
+// All functions have to be called with the same opengl context current.
+class DynamicResolution {
+public:
+    // The scale is kept between |min_scale| and |max_scale| and starts at 1
+    void init(float min_scale, float max_scale);
+    void deinit();
+
+    // The gpu time of the commands between these two is measured. The result is read a few frames later by |update|
+    void begin_gpu_timer();
+    void end_gpu_timer();
+
+    // Updates the scale from the gpu timer results that are ready. |compositor_gpu_ms| is the gpu time of the whole frame as measured by the
+    // compositor, 0 if it's unknown, and |frame_missed| is true if the last frame wasn't ready in time for the display.
+    // Returns true if the scale changed
+    bool update(double frame_budget_ms, double compositor_gpu_ms, bool frame_missed);
+
+    float get_scale() const { return scale; }
+    // Smoothed gpu time of recent frames
+    double get_gpu_ms() const { return gpu_ms; }
+private:
+    void read_gpu_timers();
+
+    float min_scale = 1.0f;
+    float max_scale = 1.0f;
+    float scale = 1.0f;
+    double gpu_ms = 0.0;
+    double pass_gpu_ms = 0.0;
+    int frames_since_change = 0;
+    int frames_with_headroom = 0;
+
+    uint32_t queries[DYNAMIC_RESOLUTION_QUERIES] = {};
+    // Queries are used in a ring. |query_begin| is the oldest query that hasn't been read and |query_end| is where the next one starts
+    int query_begin = 0;
+    int query_end = 0;
+    bool timer_running = false;
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+#define GL_STATE_TEXTURE_UNITS 4
+
+struct GlStateCounters {
+    // Calls that were made because they changed the state
+    uint32_t issued = 0;
+    // Calls that were skipped because the state was already set
+    uint32_t skipped = 0;
+};
+
+// Cache of the opengl state that the render loop sets the most. Calls that would set the state to what it already is are skipped.
+// The cache is for one context. Code that changes the same state without going through the cache has to be followed by |invalidate|
+class GlState {
+public:
+    GlState() { invalidate(); }
+
+    void use_program(unsigned int program);
+    void bind_vertex_array(unsigned int vertex_array);
+    // |target| is GL_FRAMEBUFFER, GL_READ_FRAMEBUFFER or GL_DRAW_FRAMEBUFFER
+    void bind_framebuffer(unsigned int target, unsigned int framebuffer);
+    // Changes the active texture unit if needed
+    void bind_texture(int unit, unsigned int target, unsigned int texture);
+    void bind_sampler(int unit, unsigned int sampler);
+    void viewport(int x, int y, int width, int height);
+    // Only GL_DEPTH_TEST, GL_MULTISAMPLE, GL_BLEND and GL_STENCIL_TEST are cached
+    void set_enabled(unsigned int capability, bool enabled);
+
+    // Forgets the cached state, so that the next calls are all made
+    void invalidate();
+    // Returns the counters since the last call and resets them
+    GlStateCounters take_counters();
+private:
+    bool changed(unsigned int &current, unsigned int value);
+
+    GlStateCounters counters;
+    // Unknown state is ~0u, which no object name or enum value is
+    unsigned int program;
+    unsigned int vertex_array;
+    unsigned int read_framebuffer;
+    unsigned int draw_framebuffer;
+    unsigned int active_texture_unit;
+    unsigned int texture_targets[GL_STATE_TEXTURE_UNITS];
+    unsigned int textures[GL_STATE_TEXTURE_UNITS];
+    unsigned int samplers[GL_STATE_TEXTURE_UNITS];
+    int viewport_rect[4];
+    bool viewport_known;
+    unsigned int depth_test;
+    unsigned int multisample;
+    unsigned int blend;
+    unsigned int stencil_test;
+};
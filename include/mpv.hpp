@@ -6,20 +6,53 @@
 typedef struct mpv_handle mpv_handle;
 typedef struct mpv_render_context mpv_render_context;
 
+struct MpvFrameStats {
+    int64_t dropped = 0;
+    int64_t decoder_dropped = 0;
+    int64_t delayed = 0;
+    // Frames that were shown for the wrong number of display refreshes (dropped or repeated) in display-sync mode
+    int64_t mistimed = 0;
+
+    bool operator == (const MpvFrameStats &other) const {
+        return dropped == other.dropped && decoder_dropped == other.decoder_dropped && delayed == other.delayed && mistimed == other.mistimed;
+    }
+};
+
 class Mpv {
 public:
     Mpv() = default;
     ~Mpv();
 
+    // Loads libmpv with dlopen. This is done by |create| as well but can be called earlier to fail early when libmpv is missing
+    static bool load_library();
+
+    // Creates and initializes the mpv core. This doesn't need an opengl context so it can run while the rest of the
+    // application initializes, the render context is created afterwards with |create_render_context|
     bool create(bool use_system_mpv_config, const char *profile = "gpu-hq");
+    // The opengl context mpv renders with has to be current on the calling thread
+    bool create_render_context();
+    // |display_fps| is the refresh rate of the display the video is shown on (the vr headset).
+    // If it's > 0 then mpv resamples the video to it instead of timing itself against the desktop monitor
+    void set_display_fps(double display_fps);
+    // Switches between resampling to the display fps set with |set_display_fps| and timing the video by the audio.
+    // The audio is used while nothing shows the video, since the display vsyncs aren't regular then
+    void set_display_sync(bool enabled);
     bool destroy();
 
-    bool load_file(const char *path);
-    // |width| and |ħeight| are set to 0 unless there is an event to reconfigure video size
+    // If |append| is true then |path| is added to the end of the playlist, otherwise it replaces the playlist and starts playing right away
+    bool load_file(const char *path, bool append = false);
+    // |width| and |ħeight| are set to 0 unless there is an event to reconfigure video size.
+    // |quit| is set once the last file in the playlist has ended, with |error| set if that file failed to play
     void on_event(SDL_Event &event, bool *render_update, int64_t *width, int64_t *height, bool *quit, int *error);
     void seek(double seconds);
     void toggle_pause();
-    void draw(unsigned int framebuffer_id, int width, int height);
+    // Never blocks waiting for the frame target time, the caller is expected to draw once per display refresh.
+    // If |skip_rendering| is true then mpv advances to the next frame without rendering it
+    void draw(unsigned int framebuffer_id, int width, int height, bool skip_rendering = false);
+    // Call after the frame that was drawn has been presented by the display
+    void report_swap();
+    // The counters as of the last |on_event|, this doesn't wait for the mpv core
+    const MpvFrameStats& get_frame_stats() const;
 
     bool created = false;
     uint32_t wakeup_on_mpv_render_update = -1;
@@ -28,4 +61,9 @@ public:
     mpv_handle *mpv = nullptr;
     mpv_render_context *mpv_gl = nullptr;
     bool paused = false;
+    bool file_started = false;
+    int end_file_error = 0;
+private:
+    MpvFrameStats frame_stats;
+    double display_fps = 0.0;
 };
\ No newline at end of file
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <glm/glm.hpp>
+#include <glm/ext/quaternion_float.hpp>
+
+class StateWriter;
+
+struct PlacementProfile {
+    glm::vec3 position = glm::vec3(0.0f, 0.0f, 0.0f);
+    glm::quat rotation = glm::quat(0.0f, 0.0f, 0.0f, 0.0f);
+    float zoom = 0.0f;
+};
+
+// Remembers the placement of windows per application, so that switching the focused window brings back the placement that was last used for it.
+// Profiles are stored per projection mode in a file where every line is one profile:
+//   <mode>\t<class|title>\t<pattern>\t<x>|<y>|<z>\t<x>|<y>|<z>|<w>\t<zoom>
+// |mode| is sphere, sphere360, flat, plane, equirect180 or equirect360, like in the config file. |pattern| is matched against the WM_CLASS or title of the window with fnmatch.
+// Changed profiles are appended to the file and a later line replaces an earlier line with the same mode, type and pattern.
+// The file is only read at startup, all lookups after that use the profiles in memory.
+class PlacementProfiles {
+public:
+    // Reads the profiles from |path|. The file is rewritten with only the latest line of every profile if it has collected too many replaced lines
+    void load(const std::string &path, StateWriter &state_writer);
+
+    // Finds the profile for a window. Title patterns are checked first, then the exact WM_CLASS and then WM_CLASS patterns.
+    // |match| is set to the profile that matched or to the WM_CLASS of the window if none matched, and should be passed to |save|.
+    // Returns nullptr if no profile matched
+    const PlacementProfile* find(const char *mode, const std::string &wm_class, const std::string &title, std::string &match) const;
+    // Stores |profile| for |match| from |find|. Only the line of this profile is appended to the file.
+    // If |save_position| is false then the position that is stored for the profile is kept
+    void save(const char *mode, const std::string &match, PlacementProfile profile, bool save_position, StateWriter &state_writer);
+private:
+    struct Pattern {
+        std::string mode;
+        std::string pattern;
+        std::string key;
+    };
+
+    bool add_line(const std::string &line);
+
+    std::string path;
+    // Key is <mode>\t<class|title>\t<pattern>
+    std::unordered_map<std::string, PlacementProfile> profiles;
+    // Keys of |profiles| in the order they were first seen, which is the order the file is compacted in
+    std::vector<std::string> keys;
+    // Profiles that contain wildcards and can't be looked up by key, in the order they were first seen
+    std::vector<Pattern> title_patterns;
+    std::vector<Pattern> class_patterns;
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Links opengl programs, reusing the program binaries saved by a previous run when the shader sources and the driver are the same.
+// All functions have to be called with the same opengl context current.
+class ShaderCache {
+public:
+    // Cache files are stored in |directory|, which has to exist. Also enables parallel shader compilation if the driver supports it
+    void init(const std::string &directory);
+
+    // Loads the program from the cache or starts compiling it, compiling may continue in the background until |finish_programs|.
+    // |program_id| is set right away but the program can only be used after |finish_programs|, which sets it to 0 on failure
+    void add_program(const char *name, const char *vertex_shader, const char *fragment_shader, unsigned int &program_id);
+    // Waits for the programs added since the last call to be linked and saves the newly linked ones to the cache.
+    // Returns false if any of them failed to compile or link
+    bool finish_programs();
+private:
+    struct PendingProgram {
+        std::string name;
+        uint64_t key;
+        unsigned int *program_id;
+        unsigned int vertex_shader;
+        unsigned int fragment_shader;
+    };
+
+    std::string get_cache_file_path(const std::string &name) const;
+    bool load_program_binary(const std::string &name, uint64_t key, unsigned int program_id);
+    void save_program_binary(const std::string &name, uint64_t key, unsigned int program_id);
+
+    std::string directory;
+    // Hash of the driver strings, so that binaries from another driver version or gpu are never loaded
+    uint64_t driver_key = 0;
+    bool binaries_supported = false;
+    std::vector<PendingProgram> pending_programs;
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+// Writes files on a background thread so that saving state never blocks the thread that renders.
+// Writes to the same path that are queued in quick succession are coalesced, only the latest content is written.
+// Every file is written to a temporary file first and then renamed over the old one, so a crash never leaves a partially written file.
+// Appended lines are the exception, a crash while appending can leave the last line incomplete.
+class StateWriter {
+public:
+    StateWriter() = default;
+    ~StateWriter();
+    StateWriter(const StateWriter&) = delete;
+    StateWriter& operator=(const StateWriter&) = delete;
+
+    void start();
+    // Writes everything that is still queued and waits for the thread to exit. Writes queued after this are done synchronously
+    void stop();
+
+    // Queues |content| to be written to |path|, replacing content queued earlier for the same path that hasn't been written yet.
+    // Directories in |path| are created if they don't exist
+    void write(const std::string &path, std::string content);
+    // Queues |line| to be appended to |path| without rewriting the rest of the file. Lines queued for the same |key| and path that haven't
+    // been appended yet are replaced. Appends are done after a queued |write| to the same path
+    void append(const std::string &path, const std::string &key, std::string line);
+private:
+    void thread_loop();
+    static void write_file(const std::string &path, const std::string &content);
+    static void append_file(const std::string &path, const std::map<std::string, std::string> &lines);
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::map<std::string, std::string> pending_writes;
+    // Path -> key -> line
+    std::map<std::string, std::map<std::string, std::string>> pending_appends;
+    std::chrono::steady_clock::time_point last_change_time;
+    bool running = false;
+};
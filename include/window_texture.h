@@ -9,13 +9,22 @@ extern "C" {
 #include <GL/glx.h>
 #include <GL/glxext.h>
 #include <X11/Xlib.h>
+#include <X11/extensions/Xdamage.h>
 
 typedef struct {
     Display *display;
     Window window;
     Pixmap pixmap;
     GLXPixmap glx_pixmap;
+    /* Bound to the window pixmap. Pixmap textures can't have mip levels, so the window is copied to |mipmap_texture_id| */
     GLuint texture_id;
+    GLuint mipmap_texture_id;
+    GLuint framebuffers[2];
+    int width;
+    int height;
+    /* None if the x server doesn't support the damage extension, then the window is copied every frame */
+    Damage damage;
+    int damaged;
     int redirected;
 } WindowTexture;
 
@@ -29,6 +38,16 @@ void window_texture_deinit(WindowTexture *self);
 */
 int window_texture_on_resize(WindowTexture *self);
 
+/*
+    Call this when a damage notify event for the window is received.
+    The copy with mip levels is updated by the next window_texture_update.
+*/
+void window_texture_on_damage(WindowTexture *self);
+
+/* Copies the window to the texture with mip levels and regenerates them, if the window has changed since the last call */
+void window_texture_update(WindowTexture *self);
+
+/* The texture with mip levels */
 GLuint window_texture_get_opengl_texture_id(WindowTexture *self);
 
 #ifdef __cplusplus
@@ -0,0 +1,276 @@
+#include "../include/control_socket.hpp"
+#include <SDL.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <algorithm>
+
+// Clients that send longer lines than this are disconnected
+#define CONTROL_MAX_LINE_LENGTH 4096
+#define CONTROL_MAX_CLIENTS 16
+
+ControlSocket::~ControlSocket() {
+    stop();
+}
+
+bool ControlSocket::start(const std::string &path, uint32_t wakeup_event) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Control socket path is too long: %s\n", path.c_str());
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listen_fd == -1) {
+        fprintf(stderr, "Error: Failed to create control socket: %s\n", strerror(errno));
+        return false;
+    }
+
+    // A socket left behind by an instance that didn't exit cleanly would make bind fail,
+    // but a socket that still accepts connections belongs to an instance that is running
+    struct stat st;
+    if(stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        const bool in_use = probe_fd != -1 && connect(probe_fd, (sockaddr*)&addr, sizeof(addr)) == 0;
+        if(probe_fd != -1)
+            close(probe_fd);
+        if(in_use) {
+            fprintf(stderr, "Error: Control socket %s is already in use by another instance\n", path.c_str());
+            close(listen_fd);
+            listen_fd = -1;
+            return false;
+        }
+        unlink(path.c_str());
+    }
+
+    // Only the owner may connect. Connecting fails until listen is called, so restricting the permissions in between
+    // leaves no window where the socket is open to others. The process umask isn't touched, other threads create files
+    if(bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "Error: Failed to listen on control socket %s: %s\n", path.c_str(), strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    if(chmod(path.c_str(), S_IRUSR | S_IWUSR) == -1 || listen(listen_fd, 4) == -1) {
+        fprintf(stderr, "Error: Failed to listen on control socket %s: %s\n", path.c_str(), strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        unlink(path.c_str());
+        return false;
+    }
+
+    if(pipe2(wakeup_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        fprintf(stderr, "Error: Failed to create control socket pipe: %s\n", strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        unlink(path.c_str());
+        return false;
+    }
+
+    this->path = path;
+    this->wakeup_event = wakeup_event;
+    running = true;
+    thread = std::thread([this]{ thread_loop(); });
+    return true;
+}
+
+void ControlSocket::stop() {
+    if(!running)
+        return;
+
+    running = false;
+    wakeup_thread();
+    if(thread.joinable())
+        thread.join();
+
+    close(listen_fd);
+    listen_fd = -1;
+    close(wakeup_pipe[0]);
+    close(wakeup_pipe[1]);
+    wakeup_pipe[0] = -1;
+    wakeup_pipe[1] = -1;
+    unlink(path.c_str());
+}
+
+void ControlSocket::take_commands(std::vector<ControlCommand> &commands) {
+    std::lock_guard<std::mutex> lock(mutex);
+    commands.swap(this->commands);
+    this->commands.clear();
+    commands_pending.store(false, std::memory_order_release);
+}
+
+void ControlSocket::reply(uint32_t client_id, std::string reply) {
+    reply += '\n';
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        replies.push_back({ client_id, std::move(reply) });
+    }
+    wakeup_thread();
+}
+
+void ControlSocket::wakeup_thread() {
+    const char c = 0;
+    // If the pipe is full then the thread is going to wake up anyways
+    ssize_t unused = write(wakeup_pipe[1], &c, 1);
+    (void)unused;
+}
+
+// Returns false if the client should be disconnected
+bool ControlSocket::read_client(Client &client) {
+    char buffer[1024];
+    for(;;) {
+        ssize_t bytes_read = read(client.fd, buffer, sizeof(buffer));
+        if(bytes_read == 0) {
+            client.input_closed = true;
+            return true;
+        }
+        if(bytes_read == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        client.input.append(buffer, bytes_read);
+
+        bool added_commands = false;
+        size_t line_start = 0;
+        for(;;) {
+            size_t line_end = client.input.find('\n', line_start);
+            if(line_end == std::string::npos)
+                break;
+
+            size_t line_size = line_end - line_start;
+            if(line_size > 0 && client.input[line_end - 1] == '\r')
+                --line_size;
+
+            if(line_size > 0) {
+                std::lock_guard<std::mutex> lock(mutex);
+                commands.push_back({ client.id, client.input.substr(line_start, line_size) });
+                ++client.pending_replies;
+                added_commands = true;
+            }
+            line_start = line_end + 1;
+        }
+        client.input.erase(0, line_start);
+
+        if(added_commands) {
+            commands_pending.store(true, std::memory_order_release);
+            SDL_Event event;
+            memset(&event, 0, sizeof(event));
+            event.type = wakeup_event;
+            SDL_PushEvent(&event);
+        }
+
+        if(client.input.size() > CONTROL_MAX_LINE_LENGTH)
+            return false;
+    }
+}
+
+// Returns false if the client should be disconnected
+bool ControlSocket::write_client(Client &client) {
+    while(!client.output.empty()) {
+        ssize_t bytes_written = send(client.fd, client.output.data(), client.output.size(), MSG_NOSIGNAL);
+        if(bytes_written == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        client.output.erase(0, bytes_written);
+    }
+    return true;
+}
+
+void ControlSocket::thread_loop() {
+    std::vector<Client> clients;
+    std::vector<pollfd> poll_fds;
+    std::vector<ControlCommand> new_replies;
+    uint32_t next_client_id = 1;
+
+    while(running) {
+        poll_fds.clear();
+        poll_fds.push_back({ wakeup_pipe[0], POLLIN, 0 });
+        poll_fds.push_back({ listen_fd, POLLIN, 0 });
+        for(const Client &client : clients) {
+            const short events = (client.input_closed ? 0 : POLLIN) | (client.output.empty() ? 0 : POLLOUT);
+            // poll skips negative fds, otherwise a closed connection that waits for replies would report POLLHUP over and over
+            poll_fds.push_back({ events ? client.fd : -1, events, 0 });
+        }
+
+        if(poll(poll_fds.data(), poll_fds.size(), -1) == -1) {
+            if(errno == EINTR)
+                continue;
+            fprintf(stderr, "Error: Control socket poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if(poll_fds[0].revents & POLLIN) {
+            char buffer[64];
+            while(read(wakeup_pipe[0], buffer, sizeof(buffer)) > 0) {}
+        }
+
+        // |poll_fds| has the clients at the same index (offset by 2) until clients are added or removed below
+        for(size_t i = 0; i < clients.size(); ++i) {
+            Client &client = clients[i];
+            const short revents = poll_fds[2 + i].revents;
+            bool keep = true;
+            if(revents & POLLERR)
+                keep = false;
+            else if(!client.input_closed && (revents & (POLLIN | POLLHUP)))
+                keep = read_client(client);
+            if(keep && (revents & POLLOUT))
+                keep = write_client(client);
+            if(!keep) {
+                close(client.fd);
+                client.fd = -1;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            new_replies.swap(replies);
+        }
+        for(ControlCommand &reply : new_replies) {
+            for(Client &client : clients) {
+                if(client.id == reply.client_id && client.fd != -1) {
+                    client.output += reply.line;
+                    --client.pending_replies;
+                    if(!write_client(client)) {
+                        close(client.fd);
+                        client.fd = -1;
+                    }
+                    break;
+                }
+            }
+        }
+        new_replies.clear();
+
+        for(Client &client : clients) {
+            if(client.fd != -1 && client.input_closed && client.pending_replies <= 0 && client.output.empty()) {
+                close(client.fd);
+                client.fd = -1;
+            }
+        }
+        clients.erase(std::remove_if(clients.begin(), clients.end(), [](const Client &client) { return client.fd == -1; }), clients.end());
+
+        if(poll_fds[1].revents & POLLIN) {
+            for(;;) {
+                int client_fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if(client_fd == -1)
+                    break;
+
+                if(clients.size() >= CONTROL_MAX_CLIENTS) {
+                    close(client_fd);
+                    continue;
+                }
+                clients.push_back({ next_client_id++, client_fd, std::string(), std::string(), 0, false });
+            }
+        }
+    }
+
+    for(const Client &client : clients) {
+        close(client.fd);
+    }
+}
@@ -0,0 +1,109 @@
+#include "../include/dynamic_resolution.hpp"
+#include <GL/glew.h>
+#include <math.h>
+#include <algorithm>
+
+// Parts of the frame budget. Above the first the scale is lowered, below the second for long enough it's raised
+#define DYNAMIC_RESOLUTION_LOWER_LOAD 0.9
+#define DYNAMIC_RESOLUTION_RAISE_LOAD 0.7
+// The load the scale is lowered to
+#define DYNAMIC_RESOLUTION_TARGET_LOAD 0.8
+// Timer results lag behind by a few frames, a new scale isn't judged before this many frames
+#define DYNAMIC_RESOLUTION_SETTLE_FRAMES 15
+#define DYNAMIC_RESOLUTION_RAISE_FRAMES 90
+#define DYNAMIC_RESOLUTION_RAISE_STEP 0.05f
+
+void DynamicResolution::init(float min_scale, float max_scale) {
+    this->min_scale = min_scale;
+    this->max_scale = max_scale;
+    scale = std::min(std::max(1.0f, min_scale), max_scale);
+    glGenQueries(DYNAMIC_RESOLUTION_QUERIES, queries);
+}
+
+void DynamicResolution::deinit() {
+    if(queries[0] != 0) {
+        glDeleteQueries(DYNAMIC_RESOLUTION_QUERIES, queries);
+        for(uint32_t &query : queries) {
+            query = 0;
+        }
+    }
+}
+
+void DynamicResolution::begin_gpu_timer() {
+    // All queries are still waiting for their results, this frame isn't measured
+    if(queries[0] == 0 || query_end - query_begin >= DYNAMIC_RESOLUTION_QUERIES)
+        return;
+
+    glBeginQuery(GL_TIME_ELAPSED, queries[query_end % DYNAMIC_RESOLUTION_QUERIES]);
+    timer_running = true;
+}
+
+void DynamicResolution::end_gpu_timer() {
+    if(!timer_running)
+        return;
+
+    glEndQuery(GL_TIME_ELAPSED);
+    timer_running = false;
+    ++query_end;
+}
+
+void DynamicResolution::read_gpu_timers() {
+    while(query_begin != query_end) {
+        const GLuint query = queries[query_begin % DYNAMIC_RESOLUTION_QUERIES];
+        GLint available = 0;
+        glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if(!available)
+            break;
+
+        GLuint64 elapsed_ns = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed_ns);
+        pass_gpu_ms = (double)elapsed_ns * 0.000001;
+        ++query_begin;
+    }
+
+    if(query_begin >= DYNAMIC_RESOLUTION_QUERIES) {
+        query_begin -= DYNAMIC_RESOLUTION_QUERIES;
+        query_end -= DYNAMIC_RESOLUTION_QUERIES;
+    }
+}
+
+bool DynamicResolution::update(double frame_budget_ms, double compositor_gpu_ms, bool frame_missed) {
+    read_gpu_timers();
+    if(frame_budget_ms <= 0.0)
+        return false;
+
+    // The compositor's time includes the gpu work that isn't measured here, like rendering the video with mpv
+    const double frame_gpu_ms = std::max(pass_gpu_ms, compositor_gpu_ms);
+    gpu_ms = gpu_ms == 0.0 ? frame_gpu_ms : gpu_ms * 0.9 + frame_gpu_ms * 0.1;
+
+    ++frames_since_change;
+    if(frames_since_change < DYNAMIC_RESOLUTION_SETTLE_FRAMES)
+        return false;
+
+    const double load = gpu_ms / frame_budget_ms;
+    float new_scale = scale;
+    // A missed frame with a light gpu load is caused by something else, rendering at a lower resolution wouldn't help
+    if(load > DYNAMIC_RESOLUTION_LOWER_LOAD || (frame_missed && load > DYNAMIC_RESOLUTION_RAISE_LOAD)) {
+        frames_with_headroom = 0;
+        // The gpu time grows with the number of pixels, which is the square of the scale
+        const double factor = sqrt(DYNAMIC_RESOLUTION_TARGET_LOAD / std::max(load, DYNAMIC_RESOLUTION_LOWER_LOAD));
+        new_scale = std::max(min_scale, scale * (float)std::max(factor, 0.75));
+    } else if(load < DYNAMIC_RESOLUTION_RAISE_LOAD) {
+        ++frames_with_headroom;
+        if(frames_with_headroom >= DYNAMIC_RESOLUTION_RAISE_FRAMES) {
+            frames_with_headroom = 0;
+            new_scale = std::min(max_scale, scale + DYNAMIC_RESOLUTION_RAISE_STEP);
+        }
+    } else {
+        frames_with_headroom = 0;
+    }
+
+    if(new_scale == scale)
+        return false;
+
+    // Estimate of the gpu time at the new scale until measurements at the new scale come in
+    gpu_ms *= (double)(new_scale * new_scale) / (double)(scale * scale);
+    scale = new_scale;
+    frames_since_change = 0;
+    return true;
+}
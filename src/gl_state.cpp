@@ -0,0 +1,119 @@
+#include "../include/gl_state.hpp"
+#include <GL/glew.h>
+
+#define GL_STATE_UNKNOWN (~0u)
+
+bool GlState::changed(unsigned int &current, unsigned int value) {
+    if(current == value) {
+        ++counters.skipped;
+        return false;
+    }
+    current = value;
+    ++counters.issued;
+    return true;
+}
+
+void GlState::use_program(unsigned int program) {
+    if(changed(this->program, program))
+        glUseProgram(program);
+}
+
+void GlState::bind_vertex_array(unsigned int vertex_array) {
+    if(changed(this->vertex_array, vertex_array))
+        glBindVertexArray(vertex_array);
+}
+
+void GlState::bind_framebuffer(unsigned int target, unsigned int framebuffer) {
+    if(target == GL_FRAMEBUFFER) {
+        if(read_framebuffer == framebuffer && draw_framebuffer == framebuffer) {
+            ++counters.skipped;
+            return;
+        }
+        read_framebuffer = framebuffer;
+        draw_framebuffer = framebuffer;
+        ++counters.issued;
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    } else if(changed(target == GL_READ_FRAMEBUFFER ? read_framebuffer : draw_framebuffer, framebuffer)) {
+        glBindFramebuffer(target, framebuffer);
+    }
+}
+
+void GlState::bind_texture(int unit, unsigned int target, unsigned int texture) {
+    if(texture_targets[unit] == target && textures[unit] == texture) {
+        ++counters.skipped;
+        return;
+    }
+
+    if(changed(active_texture_unit, unit))
+        glActiveTexture(GL_TEXTURE0 + unit);
+
+    texture_targets[unit] = target;
+    textures[unit] = texture;
+    ++counters.issued;
+    glBindTexture(target, texture);
+}
+
+void GlState::bind_sampler(int unit, unsigned int sampler) {
+    if(changed(samplers[unit], sampler))
+        glBindSampler(unit, sampler);
+}
+
+void GlState::viewport(int x, int y, int width, int height) {
+    if(viewport_known && viewport_rect[0] == x && viewport_rect[1] == y && viewport_rect[2] == width && viewport_rect[3] == height) {
+        ++counters.skipped;
+        return;
+    }
+
+    viewport_rect[0] = x;
+    viewport_rect[1] = y;
+    viewport_rect[2] = width;
+    viewport_rect[3] = height;
+    viewport_known = true;
+    ++counters.issued;
+    glViewport(x, y, width, height);
+}
+
+void GlState::set_enabled(unsigned int capability, bool enabled) {
+    unsigned int *current = nullptr;
+    switch(capability) {
+        case GL_DEPTH_TEST:  current = &depth_test;  break;
+        case GL_MULTISAMPLE: current = &multisample; break;
+        case GL_BLEND:       current = &blend;       break;
+        case GL_STENCIL_TEST: current = &stencil_test; break;
+    }
+
+    if(current && !changed(*current, enabled))
+        return;
+
+    if(!current)
+        ++counters.issued;
+
+    if(enabled)
+        glEnable(capability);
+    else
+        glDisable(capability);
+}
+
+void GlState::invalidate() {
+    program = GL_STATE_UNKNOWN;
+    vertex_array = GL_STATE_UNKNOWN;
+    read_framebuffer = GL_STATE_UNKNOWN;
+    draw_framebuffer = GL_STATE_UNKNOWN;
+    active_texture_unit = GL_STATE_UNKNOWN;
+    for(int i = 0; i < GL_STATE_TEXTURE_UNITS; ++i) {
+        texture_targets[i] = GL_STATE_UNKNOWN;
+        textures[i] = GL_STATE_UNKNOWN;
+        samplers[i] = GL_STATE_UNKNOWN;
+    }
+    viewport_known = false;
+    depth_test = GL_STATE_UNKNOWN;
+    multisample = GL_STATE_UNKNOWN;
+    blend = GL_STATE_UNKNOWN;
+    stencil_test = GL_STATE_UNKNOWN;
+}
+
+GlStateCounters GlState::take_counters() {
+    GlStateCounters result = counters;
+    counters = GlStateCounters();
+    return result;
+}
@@ -35,6 +35,12 @@
 #include "../include/window_texture.h"
 #include "../include/mpv.hpp"
 #include "../include/config.hpp"
+#include "../include/shader_cache.hpp"
+#include "../include/state_writer.hpp"
+#include "../include/placement_profiles.hpp"
+#include "../include/control_socket.hpp"
+#include "../include/dynamic_resolution.hpp"
+#include "../include/gl_state.hpp"
 
 #include <SDL.h>
 #include <SDL_opengl.h>
@@ -52,21 +58,24 @@
 #include <xdo.h>
 
 #include <stdio.h>
+#include <float.h>
 #include <string>
 #include <cstdlib>
 #include <vector>
+#include <algorithm>
 
 #include <unistd.h>
 #include <signal.h>
 #include <libgen.h>
 
 #include <iostream>
-#include <fstream>
-#include <sstream>
 
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
+#include <future>
+#include <chrono>
 
 #ifndef _countof
 #define _countof(x) (sizeof(x)/sizeof((x)[0]))
@@ -85,10 +94,12 @@ namespace vr
 }
 
 static bool g_bPrintf = true;
+static const std::chrono::steady_clock::time_point g_launchTime = std::chrono::steady_clock::now();
 
 enum class ViewMode {
 	LEFT_RIGHT,
 	RIGHT_LEFT,
+	TOP_BOTTOM,
 	PLANE,
 	SPHERE360
 };
@@ -97,13 +108,72 @@ enum class ProjectionMode {
 	SPHERE,
 	FLAT,
 	CYLINDER, /* aka plane */
-	SPHERE360
+	SPHERE360,
+	// Drawn without a mesh, the texture coordinates are computed per fragment from the view direction
+	EQUIRECT180,
+	EQUIRECT360
+};
+
+static bool is_equirect(ProjectionMode projection_mode) {
+	return projection_mode == ProjectionMode::EQUIRECT180 || projection_mode == ProjectionMode::EQUIRECT360;
+}
+
+// States of the mpv thread. The main thread moves it forward, the mpv thread only reacts to it
+enum class MpvThreadState {
+	// Sleeps until the first video reconfig, the video size isn't known before it
+	WAITING_FOR_VIDEO,
+	// Renders on every vr frame that has new mpv frames
+	RENDERING,
+	// Frees its resources and exits. This is the final state
+	STOPPING
+};
+
+// How often input is handled while the overlay is hidden. Anything that shows the overlay is seen within this time
+#define OVERLAY_HIDDEN_WAIT_MS 50
+
+enum class CompanionMode {
+	OFF,
+	LOWRATE,
+	FULL
 };
+#define COMPANION_LOWRATE_FPS 30
+// Range of the render scale with --dynamic-resolution. The eye targets are allocated at the largest scale
+#define DYNAMIC_RESOLUTION_MIN_SCALE 0.5f
+#define DYNAMIC_RESOLUTION_MAX_SCALE 1.25f
+// Shape of the flat and plane (cylinder) screens, shared by their meshes and the --native-layer overlay
+#define FLAT_HALF_HEIGHT 0.5
+#define PLANE_HALF_HEIGHT 1.5
+#define PLANE_HALF_ANGLE 0.8
+// The plane's arc is flattened in depth by this much
+#define PLANE_DEPTH_SCALE 0.6
+// Matches the std140 layout of the EyeUniforms block in the scene shader
+struct SceneEyeUniforms
+{
+	glm::mat4 matrix;
+	GLint eye;
+	GLint padding[3];
+	// Only used by the equirectangular projections
+	glm::mat4 inverse_matrix;
+};
+
+// Run of consecutive triangles of the scene mesh that is culled as a whole. The meshes are generated row by row,
+// so consecutive triangles are close to each other and the bounds of a patch stay small
+struct ScenePatch
+{
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
+	GLint first;
+	GLsizei count;
+};
+
+#define SCENE_PATCH_VERTICES 96
+
 #define BUFFER_DEPTH 2
 class VideoBuffers
 {
 public:
-	VideoBuffers(int nWidth, int nHeight);
+	// With |bMipmaps| the textures have mip levels, which end_render regenerates for every frame
+	VideoBuffers(int nWidth, int nHeight, bool bMipmaps);
 	~VideoBuffers();
 	
 	
@@ -111,29 +181,64 @@ public:
 	GLuint get_renderFramebufferId();
 	GLuint get_showTextureId();
 	GLuint get_showFramebufferId();
+	int get_width() const { return width; }
+	int get_height() const { return height; }
 	
+	// Not thread-safe, callers that share the buffers between threads synchronize the swap themselves
 	void swap_buffer();
-	
-	std::mutex swap_mutex;
+
+	// The buffers are written and sampled from different opengl contexts, so each side fences its work on a buffer
+	// and the other side makes the gpu wait for that fence before touching the buffer.
+	// Called by the writer before rendering into the render buffer
+	void begin_render();
+	// Called by the writer after rendering into the render buffer, before swap_buffer. Generates the mip levels of the render buffer
+	void end_render();
+	// Called by the reader before sampling the show buffer
+	void begin_show();
+	// Called by the reader after the commands sampling the show buffer have been issued
+	void end_show();
 private:
 	unsigned int current_show_frame = 0;
+	int width;
+	int height;
+	bool mipmaps;
 	
 	GLuint texture_id[BUFFER_DEPTH];
 	GLuint frame_buffer_id[BUFFER_DEPTH];
+	GLsync render_fence[BUFFER_DEPTH];
+	GLsync show_fence[BUFFER_DEPTH];
 };
 
-VideoBuffers::VideoBuffers(int nWidth, int nHeight)
+VideoBuffers::VideoBuffers(int nWidth, int nHeight, bool bMipmaps) : width(nWidth), height(nHeight), mipmaps(bMipmaps)
 {
 	for(int i = 0; i < BUFFER_DEPTH; i++)
 	{
+		render_fence[i] = nullptr;
+		show_fence[i] = nullptr;
 		glGenFramebuffers(1, &frame_buffer_id[i]);
 		glBindFramebuffer(GL_FRAMEBUFFER, frame_buffer_id[i]);
 
 		glGenTextures(1, &texture_id[i]);
 		glBindTexture(GL_TEXTURE_2D, texture_id[i]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, nWidth, nHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		if(bMipmaps)
+		{
+			// A video that is shown smaller than its resolution would shimmer and thrash the texture cache without mip levels.
+			// They are allocated here so that the texture is complete before the first frame is rendered into it
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+			if(GLEW_EXT_texture_filter_anisotropic)
+			{
+				float fLargest = 0.0f;
+				glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &fLargest);
+				glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, fLargest);
+			}
+			glGenerateMipmap(GL_TEXTURE_2D);
+		}
+		else
+		{
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+		}
 		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture_id[i], 0);
 	}
 
@@ -151,6 +256,10 @@ VideoBuffers::~VideoBuffers()
 {
 	for(int i = 0; i < BUFFER_DEPTH; i++)
 	{
+		if(render_fence[i])
+			glDeleteSync(render_fence[i]);
+		if(show_fence[i])
+			glDeleteSync(show_fence[i]);
 		glDeleteTextures(1, &texture_id[i]);
 		glDeleteFramebuffers(1, &frame_buffer_id[i]);
 	}
@@ -178,10 +287,48 @@ GLuint VideoBuffers::get_showFramebufferId()
 
 void VideoBuffers::swap_buffer()
 {
-	std::lock_guard<std::mutex> lock(swap_mutex);
 	current_show_frame = (current_show_frame + 1) % BUFFER_DEPTH;
 }
 
+static void replace_fence(GLsync &fence)
+{
+	if(fence)
+		glDeleteSync(fence);
+	fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	// The fence has to reach the gpu before another context can wait for it
+	glFlush();
+}
+
+void VideoBuffers::begin_render()
+{
+	const unsigned int render_frame = (current_show_frame + 1) % BUFFER_DEPTH;
+	if(show_fence[render_frame])
+		glWaitSync(show_fence[render_frame], 0, GL_TIMEOUT_IGNORED);
+}
+
+void VideoBuffers::end_render()
+{
+	// Once per video frame here instead of for every eye that samples it
+	if(mipmaps)
+	{
+		glBindTexture(GL_TEXTURE_2D, get_renderTextureId());
+		glGenerateMipmap(GL_TEXTURE_2D);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+	replace_fence(render_fence[(current_show_frame + 1) % BUFFER_DEPTH]);
+}
+
+void VideoBuffers::begin_show()
+{
+	if(render_fence[current_show_frame])
+		glWaitSync(render_fence[current_show_frame], 0, GL_TIMEOUT_IGNORED);
+}
+
+void VideoBuffers::end_show()
+{
+	replace_fence(show_fence[current_show_frame]);
+}
+
 //-----------------------------------------------------------------------------
 // Purpose:
 //------------------------------------------------------------------------------
@@ -193,6 +340,7 @@ public:
 
 	bool BInit();
 	bool BInitGL();
+	bool BInitScene();
 	bool BInitCompositor();
 	bool BInitOverlay();
 
@@ -202,7 +350,9 @@ public:
 	bool HandleInput();
     void zoom_in();
     void zoom_out();
+    void save_zoom_state();
 	void ProcessVREvent( const vr::VREvent_t & event );
+	void UpdateOverlayVisibility();
 	void RenderFrame();
 
 	void ResetRotation();
@@ -210,16 +360,27 @@ public:
 	void MouseButton(int button, bool down);
 
 	void SetupScene();
+	void CullScenePatches( int nEyeIndex, const glm::mat4 &matrix );
 	void AddCubeToScene( const glm::mat4 &mat, std::vector<float> &vertdata );
 
+	void GetVideoRenderSize( int64_t nVideoWidth, int64_t nVideoHeight, int64_t &nRenderWidth, int64_t &nRenderHeight );
+	void UpdateVideoRenderSize( bool bForce );
+
 	bool SetupStereoRenderTargets();
 	void SetupCompanionWindow();
+	void SetupHiddenAreaMesh();
+	void SetEyeViewportSize( float fScale );
+	void UpdateDynamicResolution();
 	void SetupCameras();
 
 	void RenderStereoTargets();
 	void RenderCompanionWindow();
+	void UpdateSceneUniforms();
 	void RenderScene( vr::Hmd_Eye nEye );
-	void RenderOverlay();
+	void RenderOverlay( vr::VROverlayHandle_t ulOverlayHandle );
+	bool UseNativeLayer();
+	void UpdateNativeLayer();
+	void ClearEyeTargets();
 
 	void UpdateOverlayTitle();
 	void UpdateOverlayIcon();
@@ -227,23 +388,50 @@ public:
 
 	glm::mat4 GetHMDMatrixProjectionEye( vr::Hmd_Eye nEye );
 	glm::mat4 GetHMDMatrixPoseEye( vr::Hmd_Eye nEye );
+	glm::mat4 GetCurrentViewMatrix();
 	glm::mat4 GetCurrentViewProjectionMatrix( vr::Hmd_Eye nEye );
+	void SetupMonoCamera();
+	bool UseMonoTarget();
 	void UpdateHMDMatrixPose();
+	void LatchHMDPose();
+	void SubmitEyeTextures();
 
 	glm::mat4 ConvertSteamVRMatrixToMatrix4( const vr::HmdMatrix34_t &matPose );
 
-	GLuint CompileGLShader( const char *pchShaderName, const char *pchVertexShader, const char *pchFragmentShader );
 	bool CreateAllShaders();
+	void AddSceneProgram( ShaderCache &shader_cache, GLuint &unProgramID );
+	void AddEquirectProgram( ShaderCache &shader_cache, std::string scene_defines, std::string scene_program_name, GLuint &unProgramID );
+	bool InitSceneProgram();
 
 	bool SetCursorFromX11CursorImage(XFixesCursorImage *x11_cursor_image);
 	// Get focused window or None
 	Window get_focused_window();
+	std::string get_window_title(Window window);
 
+	void ApplyPlacementProfile();
+	void SavePlacementProfile();
+	void ApplyConfigPlacement();
+	void store_config_values();
 	void save_config();
 
+	bool SetProjectionMode( ProjectionMode newProjectionMode );
+	void HandleControlCommands();
+	std::string HandleControlCommand( const std::string &command );
+
+	// All files are written through this, never on the render thread
+	StateWriter state_writer;
+	PlacementProfiles placement_profiles;
+	const char *control_socket_path = nullptr;
+	ControlSocket control_socket;
+	std::vector<ControlCommand> control_commands;
+	// Profile of the source window, see PlacementProfiles::find
+	std::string placement_profile_match;
+	// The first window keeps the placement from the command line and config file when it has no profile
+	bool placement_profile_checked = false;
 	int exit_code = 0;
 	bool bQuit = false;
-	bool bQuitSignal = false;
+	// Set from signal handlers and the mpv thread
+	std::atomic<bool> bQuitSignal{ false };
 private: 
 	bool m_bDebugOpenGL;
 	bool m_bVblank;
@@ -252,6 +440,16 @@ private:
 	vr::IVRSystem *m_pHMD;
 	vr::TrackedDevicePose_t m_rTrackedDevicePose[ vr::k_unMaxTrackedDeviceCount ];
 	glm::mat4 m_rmat4DevicePose[ vr::k_unMaxTrackedDeviceCount ];
+	// Pose of the hmd predicted for when the frame is shown, sampled right before rendering, see LatchHMDPose
+	vr::TrackedDevicePose_t m_latchedHMDPose = {};
+	bool m_bExplicitTiming = false;
+	float m_fVsyncToPhotons = 0.0f;
+	// Performance counter values of when WaitGetPoses returned and when the pose was latched, 0 before the first one
+	Uint64 pose_wait_time = 0;
+	Uint64 pose_latch_time = 0;
+	// Smoothed time from sampling the pose to submitting the frame rendered with it, for the latched pose and for the pose of WaitGetPoses
+	double pose_to_submit_ms = 0.0;
+	double pose_wait_to_submit_ms = 0.0;
 
 private: // SDL bookkeeping
 	SDL_Window *m_pCompanionWindow;
@@ -259,6 +457,9 @@ private: // SDL bookkeeping
 	uint32_t m_nCompanionWindowHeight;
 
 	SDL_GLContext m_pContext;
+	// The mpv thread owns this context for its whole lifetime. It's bound to its own hidden window
+	// so that it never has to share a drawable (and a lock) with the render thread
+	SDL_Window *m_pMpvWindow;
 	SDL_GLContext m_pMpvContext;
 
 private: // OpenGL bookkeeping
@@ -283,9 +484,16 @@ private: // OpenGL bookkeeping
 	float m_fFarClip;
 
 	unsigned int m_uiVertcount;
+	std::vector<ScenePatch> m_scenePatches;
+	// Vertex ranges of the patches that are visible to each eye this frame, adjacent patches are merged into one range
+	std::vector<GLint> m_sceneDrawFirsts[2];
+	std::vector<GLsizei> m_sceneDrawCounts[2];
 
 	GLuint m_glSceneVertBuffer;
 	GLuint m_unSceneVAO;
+	// Per eye EyeUniforms block of the scene shader, one SceneEyeUniforms per eye at a multiple of m_nSceneEyeUniformsStride
+	GLuint m_glSceneEyeUniformBuffer = 0;
+	GLint m_nSceneEyeUniformsStride = 0;
 	GLuint m_unCompanionWindowVAO;
 	GLuint m_glCompanionWindowIDVertBuffer;
 	GLuint m_glCompanionWindowIDIndexBuffer;
@@ -297,6 +505,14 @@ private: // OpenGL bookkeeping
 
 	glm::mat4 m_mat4ProjectionLeft;
 	glm::mat4 m_mat4ProjectionRight;
+	// Projection of the union of both eyes' fields of view, from the center of the head
+	glm::mat4 m_mat4ProjectionMono;
+	// Part of the mono image that each eye sees, v = 0 is the top of the image like for all texture bounds
+	vr::VRTextureBounds_t m_monoEyeBounds[2];
+	// False if the eyes aren't parallel, like on headsets with canted displays, then they can't share an image
+	bool m_bMonoPossible = false;
+	// Whether the current frame is rendered once for both eyes
+	bool m_bMonoFrame = false;
 
 	glm::vec3 current_pos = glm::vec3(0.0f, 0.0f, 0.0f);
 	glm::vec3 hmd_pos = glm::vec3(0.0f, 0.0f, 0.0f);
@@ -322,9 +538,6 @@ private: // OpenGL bookkeeping
 	GLuint m_unSceneProgramID;
 	GLuint m_unCompanionWindowProgramID;
 
-	GLint m_nSceneMatrixLocation;
-	GLint m_nSceneTextureOffsetXLocation;
-	GLint m_nSceneTextureScaleXLocation;
 	GLint m_nCursorLocation;
 	GLint m_nArrowSizeLocation = -1;
 	GLint m_myTextureLocation = -1;
@@ -332,6 +545,7 @@ private: // OpenGL bookkeeping
 
 	struct FramebufferDesc
 	{
+		// Depth buffer, or with --lean-targets a stencil buffer for the hidden area. 0 if there is none
 		GLuint m_nDepthBufferId;
 		GLuint m_nRenderTextureId;
 		GLuint m_nRenderFramebufferId;
@@ -340,17 +554,43 @@ private: // OpenGL bookkeeping
 	};
 	FramebufferDesc leftEyeDesc;
 	FramebufferDesc rightEyeDesc;
+	// One image covering both eyes' fields of view that is submitted to both eyes when the content is mono and far away,
+	// see UseMonoTarget. Created the first time it's used
+	FramebufferDesc monoEyeDesc = {};
 
 	//FramebufferDesc mpvDesc;
+	// Replaced by the mpv thread when the video size changes. Guarded by mpv_buffers_mutex, which the render thread holds while it renders a frame
 	VideoBuffers* mpvBuffers = nullptr;
-
-	bool CreateFrameBuffer( int nWidth, int nHeight, FramebufferDesc &framebufferDesc );
-	void set_current_context(SDL_GLContext context);
-	bool take_render_update();
+	std::mutex mpv_buffers_mutex;
+	bool mpv_buffers_changed = false;
+
+	bool CreateFrameBuffer( int nWidth, int nHeight, bool bHiddenArea, FramebufferDesc &framebufferDesc );
+	void RenderEyeTarget( vr::Hmd_Eye nEye, const FramebufferDesc &framebufferDesc, uint32_t nTargetWidth, uint32_t nTargetHeight, uint32_t nViewportWidth, uint32_t nViewportHeight );
+	void PrintEyeTargetMemory();
+	void InvalidateEyeTarget( const FramebufferDesc &framebufferDesc );
+	MpvThreadState wait_mpv_thread_work(uint64_t &last_display_vsync, int &render_updates);
+	void set_mpv_thread_state(MpvThreadState state);
+	void request_video_resize(int64_t width, int64_t height);
+	bool take_video_resize(int64_t &width, int64_t &height);
 	void set_render_update();
+	void signal_display_vsync();
 	
+	// Recommended size of the eye images
 	uint32_t m_nRenderWidth;
 	uint32_t m_nRenderHeight;
+	// Allocated size of the eye targets and the centered part of them that is rendered to. They only differ with --dynamic-resolution
+	uint32_t m_nEyeTargetWidth = 0;
+	uint32_t m_nEyeTargetHeight = 0;
+	uint32_t m_nEyeViewportWidth = 0;
+	uint32_t m_nEyeViewportHeight = 0;
+	// Size of the mono target and the part of it that is rendered to, like the eye targets
+	uint32_t m_nMonoTargetWidth = 0;
+	uint32_t m_nMonoTargetHeight = 0;
+	uint32_t m_nMonoViewportWidth = 0;
+	uint32_t m_nMonoViewportHeight = 0;
+	bool dynamic_resolution_enabled = false;
+	DynamicResolution dynamic_resolution;
+	uint32_t last_frame_timing_index = 0;
 
 	vr::VRActionHandle_t m_actionHideCubes = vr::k_ulInvalidActionHandle;
 	vr::VRActionSetHandle_t m_actionsetDemo = vr::k_ulInvalidActionSetHandle;
@@ -358,25 +598,49 @@ private: // OpenGL bookkeeping
 private: // X compositor
 	Display *x_display = nullptr;
 	Atom net_active_window_atom;
+	Atom net_wm_name_atom;
+	Atom utf8_string_atom;
 	Window src_window_id = None;
 	WindowTexture window_texture;
 	bool follow_focused = false;
 	bool focused_window_changed = true;
 	bool focused_window_set = false;
+	// The first entry of mpv_playlist, set if the video player is used
 	const char *mpv_file = nullptr;
+	std::vector<const char*> mpv_playlist;
 	const char *mpv_profile = "gpu-hq";
 	Mpv mpv;
 	std::mutex mpv_render_update_mutex;
 	std::condition_variable mpv_render_update_condition;
-	bool mpv_render_update = false;
+	// Number of frames mpv has made available since the mpv thread last rendered
+	int mpv_render_updates = 0;
+	// Incremented every time the vr compositor starts a new frame, the mpv thread renders in step with it
+	uint64_t display_vsync_counter = 0;
+	float m_fDisplayFrequency = 0.0f;
+	MpvFrameStats mpv_frame_stats;
+	Uint32 mpv_frame_stats_time = 0;
 	int64_t mpv_video_width = 0;
 	int64_t mpv_video_height = 0;
+	// Size the video is rendered at, see GetVideoRenderSize
+	int64_t mpv_render_width = 0;
+	int64_t mpv_render_height = 0;
+	bool mpv_full_resolution = false;
+	// Only used by the main thread, the mpv thread follows mpv_thread_state
 	bool mpv_video_loaded = false;
-	bool mpv_loaded_in_thread = false;
-	bool running = true;
-	std::mutex context_mutex;
+	// Video size the mpv thread has yet to allocate buffers for. Guarded by mpv_render_update_mutex
+	bool mpv_video_resize = false;
+	int64_t mpv_video_resize_width = 0;
+	int64_t mpv_video_resize_height = 0;
+	// Only changed with mpv_render_update_mutex locked so that the mpv thread can't miss the change, see set_mpv_thread_state
+	std::atomic<MpvThreadState> mpv_thread_state{ MpvThreadState::WAITING_FOR_VIDEO };
+	// Set while the video isn't shown anywhere. mpv still plays but the mpv thread skips rendering its frames
+	std::atomic<bool> mpv_output_hidden{ false };
 
 	std::thread mpv_thread;
+	// Startup work that runs while the main thread sets up the window and opengl, see BInit
+	std::shared_future<vr::EVRInitError> vr_init_result;
+	std::shared_future<bool> mpv_create_result;
+	bool first_content_frame_logged = false;
 
 	int mouse_x = 0;
 	int mouse_y = 0;
@@ -389,12 +653,16 @@ private: // X compositor
 
 	int x_fixes_event_base;
 	int x_fixes_error_base;
+	// -1 if the x server doesn't support the damage extension
+	int x_damage_event_base = -1;
 	int prev_visibility_state = VisibilityFullyObscured;
 
 	GLint pixmap_texture_width = 1;
 	GLint pixmap_texture_height = 1;
 
 	ProjectionMode projection_mode = ProjectionMode::SPHERE;
+	CompanionMode companion_mode = CompanionMode::FULL;
+	Uint32 companion_window_time = 0;
 	double zoom = 0.0;
 	float cursor_scale = 2.0f;
 	ViewMode view_mode = ViewMode::LEFT_RIGHT;
@@ -402,6 +670,27 @@ private: // X compositor
 	bool cursor_wrap = true;
 	bool free_camera = false;
 	bool reduce_flicker = false;
+	bool synthetic_hidden_area = false;
+	// The eye targets have no depth buffer, see CreateFrameBuffer
+	bool lean_targets = false;
+	// Mono flat and plane content is rendered once for both eyes as well, not just panoramas. See UseMonoTarget
+	bool mono_render = false;
+	// Flat and plane screens are shown as a world-locked overlay that the compositor samples directly, see UpdateNativeLayer
+	bool native_layer = false;
+	vr::VROverlayHandle_t native_layer_handle = vr::k_ulOverlayHandleInvalid;
+	bool native_layer_visible = false;
+	// Whether the current frame shows the screen with the overlay instead of rendering it
+	bool m_bNativeLayerFrame = false;
+	// The eye targets only show black behind the overlay, they are cleared once when it's shown
+	bool m_bEyeTargetsCleared = false;
+	// Head position of the last reset, where the overlay is anchored without --free-camera
+	glm::vec3 native_layer_pos = glm::vec3(0.0f, 0.0f, 0.0f);
+	bool native_layer_pos_set = false;
+	// Last placement given to the compositor, it's only set again when it changes
+	float native_layer_width = 0.0f;
+	float native_layer_curvature = -1.0f;
+	float native_layer_texel_aspect = 0.0f;
+	glm::mat4 native_layer_transform = glm::mat4(0.0f);
 	bool use_system_mpv_config = false;
 	double reduce_flicker_counter = 0.0;
 
@@ -419,15 +708,30 @@ private: // X compositor
 
 	bool overlay_mode = false;
 	vr::VROverlayHandle_t overlay_handle = vr::k_ulOverlayHandleInvalid;
+	// Nothing is rendered or submitted while the overlay can't be seen, see RunMainLoop
+	bool overlay_visible = false;
 	vr::VROverlayHandle_t thumbnail_handle = vr::k_ulOverlayHandleInvalid;
-	VideoBuffers *overlay_buffers = nullptr;
-	GLuint m_unOverlayProgramID = 0;
+
+	// The hidden area meshes of both eyes, left eye first. They are drawn into the depth buffer before the scene,
+	// so that the pixels that can't be seen through the lenses fail the depth test and are never shaded
+	GLuint m_unHiddenAreaProgramID = 0;
+	GLuint m_unHiddenAreaVAO = 0;
+	GLuint m_glHiddenAreaVertBuffer = 0;
+	GLint m_nHiddenAreaFirst[2] = { 0, 0 };
+	GLsizei m_nHiddenAreaCount[2] = { 0, 0 };
+	// Part of each eye's render target that is covered by the hidden area mesh
+	float m_fHiddenAreaFraction[2] = { 0.0f, 0.0f };
 	const char *overlay_key = "vr-video-player";
 	float overlay_width = 2.5f;
 	xdo_t *overlay_xdo = nullptr;
 	Atom overlay_icon_atom;
 	bool overlay_mouse_controls = true;
-	GLint m_unOverlayTextureLoc;
+	GLint m_nCompanionUVScaleLocation = -1;
+	GLuint m_unMipmapSampler = 0;
+	GLuint m_unLinearSampler = 0;
+	// State of the render loop, invalidated at the start of every frame since other code and the compositor change state directly
+	GlState gl_state;
+	GlStateCounters gl_state_frame_counters;
 };
 
 
@@ -516,8 +820,32 @@ void dprintf( const char *fmt, ... )
 		printf( "%s", buffer );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Outputs how long after launch a startup phase finished. Called from
+//          the threads that initialize in parallel as well.
+//-----------------------------------------------------------------------------
+static void log_init_phase( const char *phase )
+{
+	double fMilliseconds = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - g_launchTime ).count();
+	fprintf( stderr, "Startup: %s after %.1f ms\n", phase, fMilliseconds );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Linked programs are cached per driver so that later launches don't
+//          compile the shaders again
+//-----------------------------------------------------------------------------
+static void init_shader_cache( ShaderCache &shader_cache )
+{
+	char shader_cache_dir[PATH_MAX];
+	snprintf(shader_cache_dir, sizeof(shader_cache_dir), "%s/shader_cache", get_config_dir().c_str());
+	if(create_directory_recursive(shader_cache_dir) == 0)
+		shader_cache.init(shader_cache_dir);
+	else
+		shader_cache.init("");
+}
+
 static void usage() {
-	fprintf(stderr, "usage: vr-video-player [--sphere|--sphere360|--flat|--plane] [--left-right|--right-left] [--stretch|--no-stretch] [--zoom zoom-level] [--cursor-scale scale] [--cursor-wrap|--no-cursor-wrap] [--follow-focused|--video video|<window_id>] [--use-system-mpv-config] [--mpv-profile <profile>] [--free-camera] [--reduce-flicker] [--overlay] [--overlay-key <key>] [--overlay-mouse|--no-overlay-mouse] [--overlay-width <width>]\n");
+	fprintf(stderr, "usage: vr-video-player [--sphere|--sphere360|--flat|--plane|--equirect180|--equirect360] [--left-right|--right-left|--top-bottom|--mono] [--stretch|--no-stretch] [--zoom zoom-level] [--cursor-scale scale] [--cursor-wrap|--no-cursor-wrap] [--follow-focused|--video video|<window_id>] [--use-system-mpv-config] [--mpv-profile <profile>] [--mpv-full-resolution] [--free-camera] [--dynamic-resolution] [--lean-targets] [--mono-render] [--native-layer] [--synthetic-hidden-area] [--reduce-flicker] [--control-socket <path>] [--companion=off|lowrate|full] [--overlay] [--overlay-key <key>] [--overlay-mouse|--no-overlay-mouse] [--overlay-width <width>]\n");
     fprintf(stderr, "\n");
 	fprintf(stderr, "OPTIONS\n");
     fprintf(stderr, "  --sphere                  View the window as a stereoscopic 180 degrees screen (half sphere). The view will be attached to your head in vr. This is recommended for 180 degrees videos. This is the default value\n");
@@ -526,18 +854,30 @@ static void usage() {
     fprintf(stderr, "  --left-right              This option is used together with --flat, to specify if the left side of the window is meant to be viewed with the left eye and the right side is meant to be viewed by the right eye. This is the default value\n");
     fprintf(stderr, "  --right-left              This option is used together with --flat, to specify if the left side of the window is meant to be viewed with the right eye and the right side is meant to be viewed by the left eye\n");
     fprintf(stderr, "  --plane                   View the window as a slightly curved screen. This is recommended for non-stereoscopic content\n");
+	fprintf(stderr, "  --equirect180             View the window as a 180 degrees equirectangular video. The projection is computed per pixel, so unlike --sphere the image isn't pinched towards the top and bottom. The view will be attached to your head in vr\n");
+	fprintf(stderr, "  --equirect360             View the window as a 360 degrees equirectangular video. The view will be attached to your head in vr\n");
+	fprintf(stderr, "  --top-bottom              The top half of the window is meant to be viewed with the left eye and the bottom half with the right eye\n");
+	fprintf(stderr, "  --mono                    The whole window is viewed with both eyes. This option is used together with --equirect180 or --equirect360, --plane is always mono\n");
     fprintf(stderr, "  --stretch                 This option is used together with --flat, To specify if the size of both sides of the window should be combined and stretch to that size when viewed in vr. This is the default value\n");
     fprintf(stderr, "  --no-stretch              This option is used together with --flat, To specify if the size of one side of the window should be the size of the whole window when viewed in vr. This is the option you want if the window looks too wide\n");
     fprintf(stderr, "  --zoom <zoom>             Change the distance to the window. This should be a positive value. In flat and plane modes, this is the distance to the window when the window is reset (with W key or controller trigger button). The default value is 0 for all modes except sphere mode, where the default value is 1. This value is unused for sphere360 mode\n");
     fprintf(stderr, "  --cursor-scale <scale>    Change the size of the cursor. This should be a positive value. If set to 0, then the cursor is hidden. The default value is 1 for all modes except sphere mode, where the default value is 0. The cursor is always hidden in sphere360 mode\n");
     fprintf(stderr, "  --cursor-wrap             If this option is set, then the cursor position in the vr view will wrap around when it reached the center of the window (i.e when it reaches the edge of one side of the stereoscopic view). This option is only valid for stereoscopic view (flat and sphere modes)\n");
     fprintf(stderr, "  --no-cursor-wrap          If this option is set, then the cursor position in the vr view will match the the real cursor position inside the window\n");
-	fprintf(stderr, "  --reduce-flicker          A hack to reduce flickering in low resolution text when the headset is not moving by moving the window around quickly by a few pixels\n");
+	fprintf(stderr, "  --reduce-flicker          A hack to reduce flickering in low resolution text when the headset is not moving by moving the window around quickly by a few pixels. Shouldn't be needed anymore since windows and videos are mipmapped\n");
 	fprintf(stderr, "  --free-camera             If this option is set, then the camera wont follow your position\n");
+	fprintf(stderr, "  --dynamic-resolution      Lower the resolution the vr view is rendered at when the gpu can't keep up with the headset's refresh rate, and raise it up to %d%% of the recommended resolution when there is headroom\n", (int)(DYNAMIC_RESOLUTION_MAX_SCALE * 100.0f));
+	fprintf(stderr, "  --lean-targets            Render the vr view without a depth buffer, which the scene doesn't need since it's one surface that never overlaps itself. The hidden area is masked with a stencil buffer instead. Uses less gpu memory and bandwidth\n");
+	fprintf(stderr, "  --mono-render             Render mono flat and plane content once for both eyes, which shows it at an infinite distance instead of at the distance of the screen but takes about half the gpu time. Mono panoramas (--sphere360, or --sphere, --equirect180 and --equirect360 with --mono) are always rendered once\n");
+	fprintf(stderr, "  --native-layer            Show flat and plane screens as an overlay that the compositor draws directly from the window or video, instead of drawing them into the vr view first. Sharper and takes less gpu time. The screen is world-locked like with --free-camera, the cursor isn't drawn and --top-bottom content is still drawn into the vr view\n");
+	fprintf(stderr, "  --synthetic-hidden-area   Skip the pixels outside of an ellipse in each eye instead of using the hidden area mesh of the headset. For testing with drivers that don't provide one, like the null driver\n");
+	fprintf(stderr, "  --control-socket <path>   Create a unix domain socket at <path> that accepts commands, one per line. See the README for the commands\n");
+	fprintf(stderr, "  --companion=<mode>        How the desktop window mirrors the vr view. \"full\" updates it every vr frame, \"lowrate\" updates it at most %d times per second without waiting for the monitor's vsync and \"off\" leaves it blank (it still takes keyboard input). Defaults to \"full\"\n", COMPANION_LOWRATE_FPS);
     fprintf(stderr, "  --follow-focused          If this option is set, then the selected window will be the focused window. vr-video-player will automatically update when the focused window changes. Either this option, --video or window_id should be used\n");
-	fprintf(stderr, "  --video <video>           Select the video to play (using mpv). Either this option, --follow-focused or window_id should be used\n");
+	fprintf(stderr, "  --video <video>           Select the video to play (using mpv). Either this option, --follow-focused or window_id should be used. Can be used multiple times to play the videos one after another, the program exits after the last one\n");
 	fprintf(stderr, "  --use-system-mpv-config   Use system (~/.config/mpv/mpv.conf) mpv config. Disabled by default\n");
 	fprintf(stderr, "  --mpv-profile <profile>   Which mpv profile to use. Only applicable when using --video option. Optional, defaults to \"gpu-hq\"\n");
+	fprintf(stderr, "  --mpv-full-resolution     Render the video at its original resolution. By default the video is scaled down to the resolution the headset can resolve at the size the video is shown at\n");
 	fprintf(stderr, "  --overlay                 Run as an OpenVR overlay rather than a standalone application.\n");
 	fprintf(stderr, "  --overlay-key <key>       Name used to identify the OpenVR overlay. Defaults to \"vr-video-player\".\n");
 	fprintf(stderr, "  --overlay-mouse           Enable the translation of VR events into mouse events when running as an overlay. This is the default value.\n");
@@ -557,6 +897,19 @@ static void usage() {
 	exit(1);
 }
 
+// Name of the projection mode in the config and placement profile files
+static const char* get_config_section(ProjectionMode projection_mode) {
+	switch(projection_mode) {
+		case ProjectionMode::SPHERE:    return "sphere";
+		case ProjectionMode::FLAT:      return "flat";
+		case ProjectionMode::CYLINDER:  return "plane";
+		case ProjectionMode::SPHERE360: return "sphere360";
+		case ProjectionMode::EQUIRECT180: return "equirect180";
+		case ProjectionMode::EQUIRECT360: return "equirect360";
+	}
+	return "sphere";
+}
+
 static void get_config_values(const Config &config, ProjectionMode projection_mode, glm::vec3 &pos, glm::quat &rot, float &zoom) {
 	switch(projection_mode) {
 		case ProjectionMode::SPHERE: {
@@ -583,6 +936,18 @@ static void get_config_values(const Config &config, ProjectionMode projection_mo
 			zoom = config.sphere360.zoom;
 			break;
 		}
+		case ProjectionMode::EQUIRECT180: {
+			pos = config.equirect180.position;
+			rot = config.equirect180.rotation;
+			zoom = config.equirect180.zoom;
+			break;
+		}
+		case ProjectionMode::EQUIRECT360: {
+			pos = config.equirect360.position;
+			rot = config.equirect360.rotation;
+			zoom = config.equirect360.zoom;
+			break;
+		}
 	}
 }
 
@@ -592,6 +957,7 @@ static void get_config_values(const Config &config, ProjectionMode projection_mo
 CMainApplication::CMainApplication( int argc, char *argv[] )
 	: m_pCompanionWindow(NULL)
 	, m_pContext(NULL)
+	, m_pMpvWindow(NULL)
 	, m_pMpvContext(NULL)
 	, m_nCompanionWindowWidth( 800 )
 	, m_nCompanionWindowHeight( 600 )
@@ -602,9 +968,6 @@ CMainApplication::CMainApplication( int argc, char *argv[] )
 	, m_bVblank( false )
 	, m_bGlFinishHack( false )
 	, m_unSceneVAO( 0 )
-	, m_nSceneMatrixLocation( -1 )
-	, m_nSceneTextureOffsetXLocation( -1 )
-	, m_nSceneTextureScaleXLocation( -1 )
 	, m_nCursorLocation( -1 )
 	, m_iTrackedControllerCount( 0 )
 	, m_iTrackedControllerCount_Last( -1 )
@@ -685,6 +1048,27 @@ CMainApplication::CMainApplication( int argc, char *argv[] )
 			projection_mode = ProjectionMode::SPHERE360;
 			projection_arg = argv[i];
 			view_mode_arg = argv[i];
+		} else if(strcmp(argv[i], "--equirect180") == 0 || strcmp(argv[i], "--equirect360") == 0) {
+			if(projection_arg) {
+				fprintf(stderr, "Error: %s option can't be used together with the %s option\n", argv[i], projection_arg);
+				exit(1);
+			}
+			projection_mode = strcmp(argv[i], "--equirect180") == 0 ? ProjectionMode::EQUIRECT180 : ProjectionMode::EQUIRECT360;
+			projection_arg = argv[i];
+		} else if(strcmp(argv[i], "--top-bottom") == 0) {
+			if(view_mode_arg) {
+				fprintf(stderr, "Error: --top-bottom option can't be used together with the %s option\n", view_mode_arg);
+				exit(1);
+			}
+			view_mode = ViewMode::TOP_BOTTOM;
+			view_mode_arg = argv[i];
+		} else if(strcmp(argv[i], "--mono") == 0) {
+			if(view_mode_arg) {
+				fprintf(stderr, "Error: --mono option can't be used together with the %s option\n", view_mode_arg);
+				exit(1);
+			}
+			view_mode = ViewMode::PLANE;
+			view_mode_arg = argv[i];
 		} else if(strcmp(argv[i], "--stretch") == 0) {
 			stretch = true;
 		} else if(strcmp(argv[i], "--no-stretch") == 0) {
@@ -714,17 +1098,47 @@ CMainApplication::CMainApplication( int argc, char *argv[] )
 				fprintf(stderr, "Error: window_id option can't be used together with the --video option\n");
 				exit(1);
 			}
-			mpv_file = argv[i + 1];
+			// Every --video is another entry in the playlist
+			if(!mpv_file)
+				mpv_file = argv[i + 1];
+			mpv_playlist.push_back(argv[i + 1]);
 			++i;
 		} else if(strcmp(argv[i], "--use-system-mpv-config") == 0) {
 			use_system_mpv_config = true;
 		} else if(strcmp(argv[i], "--mpv-profile") == 0 && i < argc - 1) {
 			mpv_profile = argv[i + 1];
 			++i;
+		} else if(strcmp(argv[i], "--mpv-full-resolution") == 0) {
+			mpv_full_resolution = true;
 		} else if(strcmp(argv[i], "--free-camera") == 0) {
 			free_camera = true;
+		} else if(strcmp(argv[i], "--lean-targets") == 0) {
+			lean_targets = true;
+		} else if(strcmp(argv[i], "--mono-render") == 0) {
+			mono_render = true;
+		} else if(strcmp(argv[i], "--native-layer") == 0) {
+			native_layer = true;
+		} else if(strcmp(argv[i], "--synthetic-hidden-area") == 0) {
+			synthetic_hidden_area = true;
+		} else if(strcmp(argv[i], "--dynamic-resolution") == 0) {
+			dynamic_resolution_enabled = true;
+		} else if(strcmp(argv[i], "--control-socket") == 0 && i < argc - 1) {
+			control_socket_path = argv[i + 1];
+			++i;
 		} else if(strcmp(argv[i], "--reduce-flicker") == 0) {
 			reduce_flicker = true;
+		} else if(strncmp(argv[i], "--companion=", 12) == 0) {
+			const char *companion_mode_arg = argv[i] + 12;
+			if(strcmp(companion_mode_arg, "off") == 0) {
+				companion_mode = CompanionMode::OFF;
+			} else if(strcmp(companion_mode_arg, "lowrate") == 0) {
+				companion_mode = CompanionMode::LOWRATE;
+			} else if(strcmp(companion_mode_arg, "full") == 0) {
+				companion_mode = CompanionMode::FULL;
+			} else {
+				fprintf(stderr, "Error: --companion should be off, lowrate or full, was %s\n", companion_mode_arg);
+				exit(1);
+			}
 		} else if(strcmp(argv[i], "--overlay") == 0) {
 			overlay_mode = true;
 		} else if(strcmp(argv[i], "--overlay-key") == 0 && i < argc - 1) {
@@ -779,6 +1193,10 @@ CMainApplication::CMainApplication( int argc, char *argv[] )
 		cursor_scale = 0.001f;
 	}
 
+	// Zoom has no effect on an image that is infinitely far away
+	if(is_equirect(projection_mode))
+		zoom = 0.0f;
+
 	// other initialization tasks are done in BInit
 	memset(m_rDevClassChar, 0, sizeof(m_rDevClassChar));
 
@@ -789,6 +1207,10 @@ CMainApplication::CMainApplication( int argc, char *argv[] )
 	m_bDebugOpenGL = true;
 #endif
 
+	// Only read once here, switching windows only looks up the profiles in memory
+	if(!mpv_file)
+		placement_profiles.load(get_config_dir() + "/profiles", state_writer);
+
 	config = read_config(config_exists);
 	if(!config_exists)
 		return;
@@ -876,6 +1298,12 @@ static void grabkeys(Display *display) {
 //-----------------------------------------------------------------------------
 bool CMainApplication::BInit()
 {
+	state_writer.start();
+
+	// Fail before starting vr if the video can't be played
+	if(mpv_file && !Mpv::load_library())
+		return false;
+
 	x_display = XOpenDisplay(nullptr);
 	if (!x_display)
 	{
@@ -890,12 +1318,19 @@ bool CMainApplication::BInit()
 		fprintf(stderr, "Failed to get _NET_ACTIVE_WINDOW atom\n");
 		return false;
 	}
+	net_wm_name_atom = XInternAtom(x_display, "_NET_WM_NAME", False);
+	utf8_string_atom = XInternAtom(x_display, "UTF8_STRING", False);
 
 	if(!XFixesQueryExtension(x_display, &x_fixes_event_base, &x_fixes_error_base)) {
 		fprintf(stderr, "Your x11 server is missing the xfixes extension\n");
 		return false;
 	}
 
+	// Optional, without it the window is copied for every frame instead of only when it changed
+	int x_damage_error_base;
+	if(!XDamageQueryExtension(x_display, &x_damage_event_base, &x_damage_error_base))
+		x_damage_event_base = -1;
+
 	grabkeys(x_display);
 
 	if(follow_focused)
@@ -903,32 +1338,44 @@ bool CMainApplication::BInit()
 
 	Bool sup = False;
 	XkbSetDetectableAutoRepeat(x_display, True, &sup);
+	log_init_phase( "x11" );
 
 	if ( SDL_Init( SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_JOYSTICK ) < 0 )
 	{
 		printf("%s - SDL could not initialize! SDL Error: %s\n", __FUNCTION__, SDL_GetError());
 		return false;
 	}
+	log_init_phase( "sdl" );
 
-	// Loading the SteamVR Runtime
-	vr::EVRInitError eError = vr::VRInitError_None;
+	if ( control_socket_path && !control_socket.start( control_socket_path, SDL_RegisterEvents( 1 ) ) )
+		return false;
 
+	// Loading the SteamVR Runtime. Connecting to it is the slowest part of startup and nothing but the scene setup
+	// depends on it, so it's done while the window, opengl, shaders and mpv are being set up.
+	// m_pHMD and m_fDisplayFrequency may only be used once vr_init_result is ready
 	vr::EVRApplicationType appType = overlay_mode ? vr::VRApplication_Overlay : vr::VRApplication_Scene;
-	m_pHMD = vr::VR_Init( &eError, appType );
+	vr_init_result = std::async( std::launch::async, [this, appType] {
+		vr::EVRInitError eError = vr::VRInitError_None;
+		vr::IVRSystem *pHMD = vr::VR_Init( &eError, appType );
+		if ( eError == vr::VRInitError_None )
+		{
+			m_pHMD = pHMD;
+			m_fDisplayFrequency = m_pHMD->GetFloatTrackedDeviceProperty( vr::k_unTrackedDeviceIndex_Hmd, vr::Prop_DisplayFrequency_Float );
+			m_fVsyncToPhotons = m_pHMD->GetFloatTrackedDeviceProperty( vr::k_unTrackedDeviceIndex_Hmd, vr::Prop_SecondsFromVsyncToPhotons_Float );
+		}
+		log_init_phase( "vr runtime" );
+		return eError;
+	} ).share();
 
-	if ( eError != vr::VRInitError_None )
-	{
-		m_pHMD = NULL;
-		char buf[1024];
-		snprintf( buf, sizeof( buf ), "Unable to init VR runtime: %s", vr::VR_GetVRInitErrorAsEnglishDescription( eError ) );
-		SDL_ShowSimpleMessageBox( SDL_MESSAGEBOX_ERROR, "VR_Init Failed", buf, NULL );
-		return false;
+	// The mpv core doesn't need opengl, it loads its config and scripts meanwhile as well
+	if(mpv_file) {
+		mpv_create_result = std::async( std::launch::async, [this] {
+			bool created = mpv.create(use_system_mpv_config, mpv_profile);
+			log_init_phase( "mpv core" );
+			return created;
+		} ).share();
 	}
 
-	auto standing_pos = m_pHMD->GetSeatedZeroPoseToStandingAbsoluteTrackingPose();
-	if(!config_exists)
-		hmd_pos += glm::vec3(standing_pos.m[0][3], standing_pos.m[1][3], standing_pos.m[2][3]);
-
 	int nWindowPosX = 700;
 	int nWindowPosY = 100;
 	Uint32 unWindowFlags = SDL_WINDOW_OPENGL;
@@ -966,7 +1413,16 @@ bool CMainApplication::BInit()
 	}
 
 	if(mpv_file) {
-		m_pMpvContext = SDL_GL_CreateContext(m_pCompanionWindow);
+		// A hidden 1x1 window serves as the offscreen surface of the mpv context. mpv renders into its own framebuffers
+		// so this surface is never drawn to, it only exists so that the context can stay current on the mpv thread
+		m_pMpvWindow = SDL_CreateWindow( "vr-video-player mpv", 0, 0, 1, 1, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN );
+		if (m_pMpvWindow == NULL)
+		{
+			printf( "%s - Offscreen mpv window could not be created! SDL Error: %s\n", __FUNCTION__, SDL_GetError() );
+			return false;
+		}
+
+		m_pMpvContext = SDL_GL_CreateContext(m_pMpvWindow);
 		if (m_pMpvContext == NULL)
 		{
 			printf( "%s - OpenGL context could not be created! SDL Error: %s\n", __FUNCTION__, SDL_GetError() );
@@ -988,11 +1444,135 @@ bool CMainApplication::BInit()
 	}
 	glGetError(); // to clear the error caused deep in GLEW
 
-	if ( SDL_GL_SetSwapInterval( m_bVblank ? 1 : 0 ) < 0 )
+	// The desktop monitor's vsync must not hold up the vr frame when the companion window is only updated now and then
+	if ( SDL_GL_SetSwapInterval( m_bVblank && companion_mode == CompanionMode::FULL ? 1 : 0 ) < 0 )
 	{
 		printf( "%s - Warning: Unable to set VSync! SDL Error: %s\n", __FUNCTION__, SDL_GetError() );
 		return false;
 	}
+	log_init_phase( "opengl context" );
+
+	if(mpv_file) {
+		mpv_thread = std::thread([&]{
+			// The mpv context stays current on this thread until it exits
+			if(SDL_GL_MakeCurrent(m_pMpvWindow, m_pMpvContext) < 0) {
+				fprintf(stderr, "Failed to make mpv opengl context current, error: %s\n", SDL_GetError());
+				return;
+			}
+
+			if(!mpv_create_result.get() || !mpv.create_render_context()) {
+				SDL_GL_MakeCurrent(m_pMpvWindow, NULL);
+				exit_code = 2;
+				bQuitSignal = true;
+				return;
+			}
+
+			// Opening the file doesn't have to wait for vr, nothing can be shown before the render loop starts anyways
+			mpv.load_file(mpv_playlist[0]);
+			for(size_t i = 1; i < mpv_playlist.size(); ++i) {
+				mpv.load_file(mpv_playlist[i], true);
+			}
+			log_init_phase( "mpv render context and loadfile" );
+
+			if(vr_init_result.get() == vr::VRInitError_None)
+				mpv.set_display_fps(m_fDisplayFrequency);
+
+			uint64_t last_display_vsync = 0;
+			bool frame_drawn = false;
+			bool display_sync = true;
+			// Buffers for a new video size. They replace mpvBuffers once they hold a frame, until then the previous size stays visible
+			VideoBuffers *pending_buffers = nullptr;
+			for(;;) {
+				int render_updates = 0;
+				const MpvThreadState state = wait_mpv_thread_work(last_display_vsync, render_updates);
+				if(state == MpvThreadState::STOPPING)
+					break;
+
+				// The frame drawn on the previous vsync has now been picked up by the vr compositor
+				if(frame_drawn) {
+					mpv.report_swap();
+					frame_drawn = false;
+				}
+
+				int64_t new_width = 0;
+				int64_t new_height = 0;
+				// The next video in the playlist often has the same size, in which case the buffers that are shown are kept
+				if(take_video_resize(new_width, new_height)) {
+					if(mpvBuffers && mpvBuffers->get_width() == new_width && mpvBuffers->get_height() == new_height) {
+						delete pending_buffers;
+						pending_buffers = nullptr;
+					} else if(!pending_buffers || pending_buffers->get_width() != new_width || pending_buffers->get_height() != new_height) {
+						delete pending_buffers;
+						pending_buffers = new VideoBuffers(new_width, new_height, true);
+					}
+				}
+
+				// The vsyncs are faked at an irregular rate while the output is hidden, resampling to them would throw off mpv's timing
+				const bool output_hidden = mpv_output_hidden.load();
+				if(display_sync == output_hidden) {
+					display_sync = !output_hidden;
+					mpv.set_display_sync(display_sync);
+				}
+
+				if(render_updates == 0)
+					continue;
+
+				VideoBuffers *target_buffers = pending_buffers ? pending_buffers : mpvBuffers;
+
+				// Nothing shows the video, mpv only has to keep advancing through its frames.
+				// mpv counts every render call as one display refresh so there is exactly one per vsync, like when it's shown
+				if(output_hidden) {
+					if(target_buffers)
+						mpv.draw(target_buffers->get_renderFramebufferId(), target_buffers->get_width(), target_buffers->get_height(), true);
+					else
+						mpv.draw(0, 1, 1, true);
+					frame_drawn = true;
+					continue;
+				}
+
+				if(!target_buffers)
+					continue;
+
+				target_buffers->begin_render();
+				GLuint current_frame_buffer_id = target_buffers->get_renderFramebufferId();
+				
+				glBindFramebuffer( GL_FRAMEBUFFER, current_frame_buffer_id );
+				glViewport(0, 0, target_buffers->get_width(), target_buffers->get_height());
+
+				glDisable(GL_DEPTH_TEST);
+
+				// mpv counts every render call as one display refresh and picks the frame for it itself, so several
+				// updates since the last vsync still only get one render
+				mpv.draw(current_frame_buffer_id, target_buffers->get_width(), target_buffers->get_height());
+
+				glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+
+				// Only show the frame once the render thread can wait for it to be finished
+				target_buffers->end_render();
+
+				VideoBuffers *previous_buffers = nullptr;
+				{
+					std::lock_guard<std::mutex> lock(mpv_buffers_mutex);
+					target_buffers->swap_buffer();
+					if(pending_buffers) {
+						previous_buffers = mpvBuffers;
+						mpvBuffers = pending_buffers;
+						mpv_buffers_changed = true;
+						pending_buffers = nullptr;
+					}
+				}
+				delete previous_buffers;
+				frame_drawn = true;
+			}
+
+			// The render context has to be freed while its opengl context is current
+			mpv.destroy();
+			delete pending_buffers;
+			delete mpvBuffers;
+			mpvBuffers = nullptr;
+			SDL_GL_MakeCurrent(m_pMpvWindow, NULL);
+		});
+	}
 
 	// cube array
  	m_iSceneVolumeWidth = m_iSceneVolumeInit;
@@ -1015,6 +1595,35 @@ bool CMainApplication::BInit()
 		printf("%s - Unable to initialize OpenGL!\n", __FUNCTION__);
 		return false;
 	}
+	log_init_phase( "shaders" );
+
+	vr::EVRInitError eError = vr_init_result.get();
+	if ( eError != vr::VRInitError_None )
+	{
+		char buf[1024];
+		snprintf( buf, sizeof( buf ), "Unable to init VR runtime: %s", vr::VR_GetVRInitErrorAsEnglishDescription( eError ) );
+		SDL_ShowSimpleMessageBox( SDL_MESSAGEBOX_ERROR, "VR_Init Failed", buf, NULL );
+		return false;
+	}
+
+	auto standing_pos = m_pHMD->GetSeatedZeroPoseToStandingAbsoluteTrackingPose();
+	if(!config_exists)
+		hmd_pos += glm::vec3(standing_pos.m[0][3], standing_pos.m[1][3], standing_pos.m[2][3]);
+
+	if (!BInitScene())
+	{
+		printf("%s - Unable to create the scene!\n", __FUNCTION__);
+		return false;
+	}
+	log_init_phase( "scene and render targets" );
+
+	if ( !overlay_mode && companion_mode == CompanionMode::OFF )
+	{
+		// Never drawn to again, it only stays open for keyboard input
+		glClearColor( 0.0f, 0.0f, 0.0f, 1.0f );
+		glClear( GL_COLOR_BUFFER_BIT );
+		SDL_GL_SwapWindow( m_pCompanionWindow );
+	}
 
         if (overlay_mode) {
                 if (!BInitOverlay()) {
@@ -1028,76 +1637,6 @@ bool CMainApplication::BInit()
 		return false;
 	}
 
-	if(mpv_file) {
-		mpv_thread = std::thread([&]{
-			set_current_context(m_pMpvContext);
-			if(!mpv.create(use_system_mpv_config, mpv_profile))
-				return;
-
-			mpv.load_file(mpv_file);
-			set_current_context(NULL);
-
-			while(running) {
-				
-				if(mpv_video_loaded && !mpv_loaded_in_thread) {
-					set_current_context(m_pMpvContext);
-					mpv_loaded_in_thread = true;
-					// TODO: Do not create depth buffer and extra framebuffers
-					//CreateFrameBuffer(mpv_video_width, mpv_video_height, mpvDesc);
-					mpvBuffers = new VideoBuffers(mpv_video_width, mpv_video_height);
-					set_current_context(NULL);
-				}
-
-				if(mpv_video_loaded) {
-					if(take_render_update()) {
-						if(!running)
-							break;
-
-						set_current_context(m_pMpvContext);
-						mpvBuffers->swap_buffer();
-						GLuint current_frame_buffer_id = mpvBuffers->get_renderFramebufferId();
-						
-						//glBindFramebuffer( GL_FRAMEBUFFER, mpvDesc.m_nRenderFramebufferId );
-						glBindFramebuffer( GL_FRAMEBUFFER, current_frame_buffer_id );
-						glViewport(0, 0, mpv_video_width, mpv_video_height);
-
-						glDisable(GL_DEPTH_TEST);
-
-						glBindVertexArray( m_unCompanionWindowVAO );
-						glUseProgram( m_unCompanionWindowProgramID );
-
-						//mpv.draw(mpvDesc.m_nRenderFramebufferId, mpv_video_width, mpv_video_height);
-						mpv.draw(current_frame_buffer_id, mpv_video_width, mpv_video_height);
-
-						glBindVertexArray( 0 );
-						glUseProgram( 0 );
-						glBindFramebuffer( GL_FRAMEBUFFER, 0 );
-						
-						set_current_context(NULL);
-					}
-/*					
-					glDisable( GL_MULTISAMPLE );
-
-					glBindFramebuffer(GL_READ_FRAMEBUFFER, mpvDesc.m_nRenderFramebufferId );
-					glBindFramebuffer(GL_DRAW_FRAMEBUFFER, mpvDesc.m_nResolveFramebufferId );
-					
-					glBlitFramebuffer( 0, 0, mpv_video_width, mpv_video_height, 0, 0, mpv_video_width, mpv_video_height, 
-						GL_COLOR_BUFFER_BIT,
-						GL_LINEAR  );
-
-					glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
-					glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0 );
-					
-
-					glEnable( GL_MULTISAMPLE );*/
-				} else {
-					usleep(1000);
-				}
-			}
-			delete mpvBuffers;
-		});
-	}
-
 	char action_manifest_path[PATH_MAX];
 	realpath("config/hellovr_actions.json", action_manifest_path);
 	if(access(action_manifest_path, F_OK) == -1) {
@@ -1115,6 +1654,7 @@ bool CMainApplication::BInit()
 		vr::VRInput()->GetActionHandle( "/actions/demo/in/HideCubes", &m_actionHideCubes );
 		vr::VRInput()->GetActionSetHandle( "/actions/demo", &m_actionsetDemo );
 	}
+	log_init_phase( "vr compositor and input" );
 
 	return true;
 }
@@ -1155,8 +1695,28 @@ bool CMainApplication::BInitGL()
 
 	//glActiveTexture(GL_TEXTURE0);
 
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	// The scene is opaque, the cursor and the window's alpha are applied in the scene shader
+	glDisable(GL_BLEND);
+
+	// Filtering is set with sampler objects when drawing, so that it doesn't have to be set on every texture.
+	// The window, video and cursor textures have mip levels, the eye targets don't
+	glGenSamplers( 1, &m_unMipmapSampler );
+	glSamplerParameteri( m_unMipmapSampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glSamplerParameteri( m_unMipmapSampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	glSamplerParameteri( m_unMipmapSampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+	glSamplerParameteri( m_unMipmapSampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
+	if( GLEW_EXT_texture_filter_anisotropic )
+	{
+		float fLargest = 0.0f;
+		glGetFloatv( GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &fLargest );
+		glSamplerParameterf( m_unMipmapSampler, GL_TEXTURE_MAX_ANISOTROPY_EXT, fLargest );
+	}
+
+	glGenSamplers( 1, &m_unLinearSampler );
+	glSamplerParameteri( m_unLinearSampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glSamplerParameteri( m_unLinearSampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	glSamplerParameteri( m_unLinearSampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+	glSamplerParameteri( m_unLinearSampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
 
 	//glActiveTexture(GL_TEXTURE1);
 	glGenTextures(1, &arrow_image_texture_id);
@@ -1165,16 +1725,38 @@ bool CMainApplication::BInitGL()
 
     glBindTexture(GL_TEXTURE_2D, 0);
 
-	glUniform1i(m_myTextureLocation, 0);
-	glUniform1i(m_arrowTextureLocation, 1);
 	glActiveTexture(GL_TEXTURE0);
 	glUseProgram( 0);
 
 	glGenVertexArrays( 1, &m_unSceneVAO );
 	glGenBuffers( 1, &m_glSceneVertBuffer );
 
+	GLint nUniformBufferOffsetAlignment = 1;
+	glGetIntegerv( GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &nUniformBufferOffsetAlignment );
+	if( nUniformBufferOffsetAlignment < 1 )
+		nUniformBufferOffsetAlignment = 1;
+	m_nSceneEyeUniformsStride = ((sizeof(SceneEyeUniforms) + nUniformBufferOffsetAlignment - 1) / nUniformBufferOffsetAlignment) * nUniformBufferOffsetAlignment;
+
+	glGenBuffers( 1, &m_glSceneEyeUniformBuffer );
+	glBindBuffer( GL_UNIFORM_BUFFER, m_glSceneEyeUniformBuffer );
+	glBufferData( GL_UNIFORM_BUFFER, 2 * m_nSceneEyeUniformsStride, nullptr, GL_STREAM_DRAW );
+	glBindBuffer( GL_UNIFORM_BUFFER, 0 );
+
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Creates the scene geometry, cameras and render targets. Needs the
+//          vr runtime since they depend on the headset.
+//-----------------------------------------------------------------------------
+bool CMainApplication::BInitScene()
+{
 	SetupScene();
 	SetupCameras();
+	// The eye targets only get a stencil buffer with --lean-targets if there is a hidden area to mask
+	if(!overlay_mode)
+		SetupHiddenAreaMesh();
 	if(!SetupStereoRenderTargets())
 		return false;
 	SetupCompanionWindow();
@@ -1195,6 +1777,25 @@ bool CMainApplication::BInitCompositor()
 		return false;
 	}
 
+	// The pose is sampled again right before rendering instead of using the one from WaitGetPoses, which is older by the time it's
+	// rendered with. In explicit timing mode the compositor is told when rendering starts so that it can account for that
+	vr::VRCompositor()->SetExplicitTimingMode( vr::VRCompositorTimingMode_Explicit_RuntimePerformsPostPresentHandoff );
+	m_bExplicitTiming = true;
+
+	// Scene applications can have overlays too. It's only shown while the projection is flat or plane, see UpdateNativeLayer
+	if ( native_layer )
+	{
+		if ( vr::VROverlay() && vr::VROverlay()->CreateOverlay( overlay_key, mpv_file ? mpv_file : "vr-video-player", &native_layer_handle ) == vr::VROverlayError_None )
+		{
+			vr::VROverlay()->SetOverlayFlag( native_layer_handle, vr::VROverlayFlags_IgnoreTextureAlpha, true );
+		}
+		else
+		{
+			fprintf( stderr, "Failed to create the native layer overlay, flat and plane screens are drawn into the vr view\n" );
+			native_layer_handle = vr::k_ulOverlayHandleInvalid;
+		}
+	}
+
 	return true;
 }
 
@@ -1241,6 +1842,8 @@ bool CMainApplication::BInitOverlay()
 
 	vr::VROverlay()->SetOverlayWidthInMeters(overlay_handle, overlay_width);
 
+	UpdateOverlayVisibility();
+
 	overlay_xdo = xdo_new_with_opened_display(x_display, nullptr, 0);
 
 	overlay_icon_atom = XInternAtom(x_display, "_NET_WM_ICON", 0);
@@ -1254,8 +1857,20 @@ bool CMainApplication::BInitOverlay()
 //-----------------------------------------------------------------------------
 void CMainApplication::Shutdown()
 {
+	control_socket.stop();
+
+	// BInit may have failed while the vr runtime or mpv were still initializing
+	if( vr_init_result.valid() )
+		vr_init_result.wait();
+	if( mpv_create_result.valid() )
+		mpv_create_result.wait();
+
+	set_mpv_thread_state(MpvThreadState::STOPPING);
+
 	if( m_pHMD )
 	{
+		if ( native_layer_handle != vr::k_ulOverlayHandleInvalid )
+			vr::VROverlay()->DestroyOverlay( native_layer_handle );
 		vr::VR_Shutdown();
 		m_pHMD = NULL;
 	}
@@ -1274,6 +1889,7 @@ void CMainApplication::Shutdown()
 			glDebugMessageCallback(nullptr, nullptr);
 		}
 		glDeleteBuffers(1, &m_glSceneVertBuffer);
+		glDeleteBuffers(1, &m_glSceneEyeUniformBuffer);
 
 		if ( m_unSceneProgramID )
 		{
@@ -1283,6 +1899,14 @@ void CMainApplication::Shutdown()
 		{
 			glDeleteProgram( m_unCompanionWindowProgramID );
 		}
+		if ( m_unHiddenAreaProgramID )
+		{
+			glDeleteProgram( m_unHiddenAreaProgramID );
+		}
+		glDeleteBuffers( 1, &m_glHiddenAreaVertBuffer );
+		glDeleteSamplers( 1, &m_unMipmapSampler );
+		glDeleteSamplers( 1, &m_unLinearSampler );
+		dynamic_resolution.deinit();
 
 		glDeleteTextures(1, &arrow_image_texture_id);
 
@@ -1297,6 +1921,12 @@ void CMainApplication::Shutdown()
 		glDeleteFramebuffers( 1, &rightEyeDesc.m_nRenderFramebufferId );
 		glDeleteTextures( 1, &rightEyeDesc.m_nResolveTextureId );
 		glDeleteFramebuffers( 1, &rightEyeDesc.m_nResolveFramebufferId );
+
+		glDeleteRenderbuffers( 1, &monoEyeDesc.m_nDepthBufferId );
+		glDeleteTextures( 1, &monoEyeDesc.m_nRenderTextureId );
+		glDeleteFramebuffers( 1, &monoEyeDesc.m_nRenderFramebufferId );
+		glDeleteTextures( 1, &monoEyeDesc.m_nResolveTextureId );
+		glDeleteFramebuffers( 1, &monoEyeDesc.m_nResolveFramebufferId );
 	/*
 		glDeleteRenderbuffers( 1, &mpvDesc.m_nDepthBufferId );
 		glDeleteTextures( 1, &mpvDesc.m_nRenderTextureId );
@@ -1312,10 +1942,26 @@ void CMainApplication::Shutdown()
 		{
 			glDeleteVertexArrays( 1, &m_unSceneVAO );
 		}
+		if( m_unHiddenAreaVAO != 0 )
+		{
+			glDeleteVertexArrays( 1, &m_unHiddenAreaVAO );
+		}
 	}
 
 	window_texture_deinit(&window_texture);
 
+	if( m_pMpvContext )
+	{
+		SDL_GL_DeleteContext(m_pMpvContext);
+		m_pMpvContext = NULL;
+	}
+
+	if( m_pMpvWindow )
+	{
+		SDL_DestroyWindow(m_pMpvWindow);
+		m_pMpvWindow = NULL;
+	}
+
 	if( m_pCompanionWindow )
 	{
 		SDL_DestroyWindow(m_pCompanionWindow);
@@ -1327,9 +1973,6 @@ void CMainApplication::Shutdown()
 	if (overlay_xdo)
 		xdo_free(overlay_xdo);
 
-	if (overlay_buffers)
-		delete overlay_buffers;
-
 	if (x_display)
 		XCloseDisplay(x_display);
 }
@@ -1340,14 +1983,7 @@ void CMainApplication::zoom_in() {
     else
         zoom -= 0.01f;
     zoom_resize = true;
-
-    std::stringstream strstr;
-    if(follow_focused)
-        strstr << "/tmp/vr-video-player_focused";
-    else
-        strstr << "/tmp/vr-video-player_" << src_window_id;
-    std::ofstream zoomstate(strstr.str());
-    zoomstate << zoom; 
+    save_zoom_state();
 }
 
 void CMainApplication::zoom_out() {
@@ -1356,14 +1992,21 @@ void CMainApplication::zoom_out() {
     else
         zoom += 0.01f;
     zoom_resize = true;
+    save_zoom_state();
+}
 
-    std::stringstream strstr;
+// The current zoom is made available to other programs in /tmp
+void CMainApplication::save_zoom_state() {
+    char path[256];
     if(follow_focused)
-        strstr << "/tmp/vr-video-player_focused";
+        snprintf(path, sizeof(path), "/tmp/vr-video-player_focused");
     else
-        strstr << "/tmp/vr-video-player_" << src_window_id;
-    std::ofstream zoomstate(strstr.str());
-    zoomstate << zoom;
+        snprintf(path, sizeof(path), "/tmp/vr-video-player_%lu", (unsigned long)src_window_id);
+
+    char content[64];
+    snprintf(content, sizeof(content), "%g", zoom);
+    state_writer.write(path, content);
+    SavePlacementProfile();
 }
 
 //-----------------------------------------------------------------------------
@@ -1430,17 +2073,21 @@ bool CMainApplication::HandleInput()
 		if(mpv_quit)
 			bRet = true;
 
-		// TODO: Allow video resize to update texture size
-		if(video_width > 0 && video_height > 0 && video_width != mpv_video_width && video_height != mpv_video_height && !mpv_video_loaded && !mpv_loaded_in_thread) {
+		// The scene is updated to the new size by RenderFrame once the mpv thread has a frame in buffers of that size
+		if(video_width > 0 && video_height > 0 && (video_width != mpv_video_width || video_height != mpv_video_height)) {
 			mpv_video_width = video_width;
 			mpv_video_height = video_height;
-			pixmap_texture_width = mpv_video_width;
-			pixmap_texture_height = mpv_video_height;
-			mpv_video_loaded = true;
-			SetupScene();
+			UpdateVideoRenderSize(true);
+			if(!mpv_video_loaded) {
+				mpv_video_loaded = true;
+				set_mpv_thread_state(MpvThreadState::RENDERING);
+			}
 		}
 	}
 
+	if(control_socket.has_commands())
+		HandleControlCommands();
+
 	XEvent xev;
 	
     if(XCheckTypedEvent(x_display, MappingNotify, &xev)) {
@@ -1491,6 +2138,12 @@ bool CMainApplication::HandleInput()
 			}
 		}
 
+		if(x_damage_event_base != -1) {
+			while(XCheckTypedWindowEvent(x_display, src_window_id, x_damage_event_base + XDamageNotify, &xev)) {
+				window_texture_on_damage(&window_texture);
+			}
+		}
+
 		if(XCheckTypedWindowEvent(x_display, src_window_id, x_fixes_event_base + XFixesCursorNotify, &xev)) {
 			XFixesCursorNotifyEvent *cursor_notify_event = (XFixesCursorNotifyEvent*)&xev;
 			if(cursor_notify_event->subtype == XFixesDisplayCursorNotify && cursor_notify_event->window == src_window_id) {
@@ -1528,6 +2181,7 @@ bool CMainApplication::HandleInput()
 		if(focused_window_changed) {
 			XSelectInput(x_display, src_window_id, StructureNotifyMask|VisibilityChangeMask|KeyPressMask|KeyReleaseMask);
 			XFixesSelectCursorInput(x_display, src_window_id, XFixesDisplayCursorNotifyMask);
+			ApplyPlacementProfile();
 		}
 
 		focused_window_changed = false;
@@ -1544,20 +2198,16 @@ bool CMainApplication::HandleInput()
 			pixmap_texture_width = 1;
 		if(pixmap_texture_height == 0)
 			pixmap_texture_height = 1;
-
-		if (overlay_mode) {
-			if (overlay_buffers) {
-				delete overlay_buffers;
-				overlay_buffers = nullptr;
-			}
-			overlay_buffers = new VideoBuffers(pixmap_texture_width, pixmap_texture_height);
-		}
 		glBindTexture(GL_TEXTURE_2D, 0);
 		SetupScene();
 	} else if(!window_resized && zoom_resize) {
 		SetupScene();
 	}
 
+	// The angular size of flat and plane surfaces depends on the zoom
+	if(zoom_resize && mpv_video_loaded)
+		UpdateVideoRenderSize(false);
+
 	if(src_window_id) {
 		Window dummyW;
 		int dummyI;
@@ -1598,8 +2248,11 @@ bool CMainApplication::HandleInput()
 			// m_mat4HMDPose[1][2], m_mat4HMDPose[2][2]);
 			//  m_resetPos = m_mat4HMDPose;
 			hmd_pos = current_pos;
+			native_layer_pos = current_pos;
+			native_layer_pos_set = true;
 			m_bResetRotation = false;
 			m_reset_rotation = glm::inverse(hmd_rot);
+			SavePlacementProfile();
 		}
 	}
 
@@ -1623,26 +2276,33 @@ void CMainApplication::RunMainLoop()
 
 	while ( !bQuit )
 	{
-		set_current_context(m_pContext);
+		// Nobody can see a hidden overlay, so only input is handled until it's shown again. There is no way to block on
+		// vr events so this wakes up every OVERLAY_HIDDEN_WAIT_MS to poll them, or right away for sdl and mpv events
+		if ( overlay_mode && !overlay_visible )
+			SDL_WaitEventTimeout( nullptr, OVERLAY_HIDDEN_WAIT_MS );
+
 		bQuit = HandleInput();
 
 		if(bQuitSignal)
 			bQuit = true;
 
-		if(bQuit) {
-			running = false;
-			set_render_update();
+		if(bQuit)
+			set_mpv_thread_state(MpvThreadState::STOPPING);
+
+		if ( overlay_mode && !overlay_visible )
+		{
+			// Lets the mpv thread skip past the frames that would have been shown meanwhile
+			if ( mpv_file )
+				signal_display_vsync();
+			continue;
 		}
 
 		RenderFrame();
-		set_current_context(NULL);
 	}
 
 	if(mpv_thread.joinable())
 		mpv_thread.join();
 
-	set_current_context(m_pContext);
-
 	if (controller)
 		SDL_JoystickClose(controller);
 
@@ -1650,6 +2310,25 @@ void CMainApplication::RunMainLoop()
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Queries whether the overlay is visible in the dashboard. Called on
+//          the events that can change it, the events themselves can also be
+//          about other overlays.
+//-----------------------------------------------------------------------------
+void CMainApplication::UpdateOverlayVisibility()
+{
+	if ( !overlay_mode || overlay_handle == vr::k_ulOverlayHandleInvalid )
+		return;
+
+	const bool bVisible = vr::VROverlay()->IsOverlayVisible( overlay_handle );
+	if ( bVisible != overlay_visible )
+		dprintf( "Overlay %s\n", bVisible ? "shown" : "hidden, pausing rendering" );
+
+	overlay_visible = bVisible;
+	mpv_output_hidden = !bVisible;
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Processes a single VR event
 //-----------------------------------------------------------------------------
@@ -1674,6 +2353,13 @@ void CMainApplication::ProcessVREvent( const vr::VREvent_t & event )
 		}
 		break;
 
+	case vr::VREvent_OverlayShown:
+	case vr::VREvent_OverlayHidden:
+	case vr::VREvent_DashboardActivated:
+	case vr::VREvent_DashboardDeactivated:
+		UpdateOverlayVisibility();
+		break;
+
 	case vr::VREvent_KeyboardCharInput:
 		if (overlay_xdo && src_window_id != None) {
 			char text[sizeof(event.data.keyboard.cNewInput) + 1] = {0};
@@ -1738,25 +2424,87 @@ void CMainApplication::ProcessVREvent( const vr::VREvent_t & event )
 //-----------------------------------------------------------------------------
 void CMainApplication::RenderFrame()
 {
-	if(mpvBuffers != nullptr)
+	std::unique_lock<std::mutex> mpv_buffers_lock(mpv_buffers_mutex, std::defer_lock);
+	if(mpv_file)
 	{
-		mpvBuffers->swap_mutex.lock();
-	}
-
+		mpv_buffers_lock.lock();
+		if(mpv_buffers_changed)
+		{
+			mpv_buffers_changed = false;
+			pixmap_texture_width = mpvBuffers->get_width();
+			pixmap_texture_height = mpvBuffers->get_height();
+			SetupScene();
+		}
+	}
+
+	if(mpvBuffers != nullptr)
+	{
+		mpvBuffers->begin_show();
+	}
+	else if(!mpv_file && src_window_id)
+	{
+		// Only copies the window and generates its mip levels when it has changed
+		window_texture_update(&window_texture);
+	}
+
+	// The companion window only mirrors the vr view on the desktop, with --companion=lowrate it's updated at a capped rate
+	bool bRenderCompanionWindow = !overlay_mode && companion_mode != CompanionMode::OFF;
+	if ( bRenderCompanionWindow && companion_mode == CompanionMode::LOWRATE )
+	{
+		Uint32 unTime = SDL_GetTicks();
+		if ( unTime - companion_window_time >= 1000 / COMPANION_LOWRATE_FPS )
+			companion_window_time = unTime;
+		else
+			bRenderCompanionWindow = false;
+	}
+
 	// for now as fast as possible
 	if ( m_pHMD )
 	{
+		// mpv, the window texture update and the compositor change gl state outside of the cache
+		gl_state.invalidate();
 		if (overlay_mode) {
-			RenderOverlay();
+			RenderOverlay( overlay_handle );
 		}
 		else {
-			RenderStereoTargets();
-			RenderCompanionWindow();
+			m_bNativeLayerFrame = UseNativeLayer();
+			UpdateNativeLayer();
+			if ( m_bNativeLayerFrame )
+			{
+				// The compositor draws the screen from the overlay, the eyes only show black around it
+				m_bMonoFrame = false;
+				if ( !m_bEyeTargetsCleared )
+					ClearEyeTargets();
+				LatchHMDPose();
+			}
+			else
+			{
+				if ( dynamic_resolution_enabled )
+				{
+					UpdateDynamicResolution();
+					dynamic_resolution.begin_gpu_timer();
+				}
+				m_bMonoFrame = UseMonoTarget();
+				// Everything that doesn't depend on the pose is done by now
+				LatchHMDPose();
+				RenderStereoTargets();
+				m_bEyeTargetsCleared = false;
+				if ( dynamic_resolution_enabled )
+					dynamic_resolution.end_gpu_timer();
+			}
+			// The companion window is only for the desktop, the compositor gets the frame first
+			SubmitEyeTextures();
+			// Submit may change gl state behind our back
+			gl_state.invalidate();
+			if ( bRenderCompanionWindow )
+				RenderCompanionWindow();
+		}
+		gl_state_frame_counters = gl_state.take_counters();
 
-			vr::Texture_t leftEyeTexture = {(void*)(uintptr_t)leftEyeDesc.m_nResolveTextureId, vr::TextureType_OpenGL, vr::ColorSpace_Gamma };
-			vr::VRCompositor()->Submit(vr::Eye_Left, &leftEyeTexture );
-			vr::Texture_t rightEyeTexture = {(void*)(uintptr_t)rightEyeDesc.m_nResolveTextureId, vr::TextureType_OpenGL, vr::ColorSpace_Gamma };
-			vr::VRCompositor()->Submit(vr::Eye_Right, &rightEyeTexture );
+		if ( !first_content_frame_logged && (mpv_file ? mpvBuffers != nullptr : window_texture_get_opengl_texture_id(&window_texture) != 0) )
+		{
+			first_content_frame_logged = true;
+			log_init_phase( "first frame with content submitted" );
 		}
 	}
 
@@ -1770,11 +2518,12 @@ void CMainApplication::RenderFrame()
 	}
 
 	// SwapWindow
-	if (!overlay_mode) {
+	if ( bRenderCompanionWindow ) {
 		SDL_GL_SwapWindow( m_pCompanionWindow );
 	}
 
 	// Clear
+	if ( bRenderCompanionWindow )
 	{
 		// We want to make sure the glFinish waits for the entire present to complete, not just the submission
 		// of the command. So, we do a clear here right here so the glFinish will wait fully for the swap.
@@ -1791,9 +2540,12 @@ void CMainApplication::RenderFrame()
 
 	if(mpvBuffers != nullptr)
 	{
-		mpvBuffers->swap_mutex.unlock();
+		mpvBuffers->end_show();
 	}
 
+	if(mpv_buffers_lock.owns_lock())
+		mpv_buffers_lock.unlock();
+
 	// Spew out the controller and pose count whenever they change.
 	if ( m_iTrackedControllerCount != m_iTrackedControllerCount_Last || m_iValidPoseCount != m_iValidPoseCount_Last )
 	{
@@ -1803,10 +2555,234 @@ void CMainApplication::RenderFrame()
 		dprintf( "PoseCount:%d(%s) Controllers:%d\n", m_iValidPoseCount, m_strPoseClasses.c_str(), m_iTrackedControllerCount );
 	}
 
+	// Spew out the mpv frame pacing counters whenever they change, at most once per second
+	if ( g_bPrintf && mpv_file && mpv_video_loaded && SDL_GetTicks() - mpv_frame_stats_time >= 1000 )
+	{
+		mpv_frame_stats_time = SDL_GetTicks();
+		const MpvFrameStats &frame_stats = mpv.get_frame_stats();
+		if ( !(frame_stats == mpv_frame_stats) )
+		{
+			mpv_frame_stats = frame_stats;
+			dprintf( "mpv frames dropped:%ld decoder dropped:%ld delayed:%ld mistimed:%ld (display %.2f Hz)\n",
+				frame_stats.dropped, frame_stats.decoder_dropped, frame_stats.delayed, frame_stats.mistimed, m_fDisplayFrequency );
+		}
+	}
+
 	if (!overlay_mode)
 		UpdateHMDMatrixPose();
 	else
 		vr::VROverlay()->WaitFrameSync(20);
+
+	if(mpv_file)
+		signal_display_vsync();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Switches between sphere, flat, plane and sphere360 while running.
+//          The placement is kept per projection mode like in the config file
+//-----------------------------------------------------------------------------
+bool CMainApplication::SetProjectionMode( ProjectionMode newProjectionMode )
+{
+	if ( newProjectionMode == projection_mode )
+		return true;
+
+	// The placement is stored for the projection that is left
+	store_config_values();
+
+	const ViewMode prevViewMode = view_mode;
+	const ProjectionMode prevProjectionMode = projection_mode;
+	if ( newProjectionMode == ProjectionMode::CYLINDER )
+		view_mode = ViewMode::PLANE;
+	else if ( newProjectionMode == ProjectionMode::SPHERE360 )
+		view_mode = ViewMode::SPHERE360;
+	else if ( view_mode == ViewMode::SPHERE360 || ( view_mode == ViewMode::PLANE && !is_equirect( newProjectionMode ) ) )
+		view_mode = ViewMode::LEFT_RIGHT;
+	projection_mode = newProjectionMode;
+
+	// The program depends on both the view mode and the projection
+	ShaderCache shader_cache;
+	init_shader_cache( shader_cache );
+	GLuint unProgramID = 0;
+	AddSceneProgram( shader_cache, unProgramID );
+	const GLuint unPrevProgramID = m_unSceneProgramID;
+	m_unSceneProgramID = unProgramID;
+	if ( !shader_cache.finish_programs() || !InitSceneProgram() )
+	{
+		if ( m_unSceneProgramID )
+			glDeleteProgram( m_unSceneProgramID );
+		m_unSceneProgramID = unPrevProgramID;
+		view_mode = prevViewMode;
+		projection_mode = prevProjectionMode;
+		InitSceneProgram();
+		return false;
+	}
+	glDeleteProgram( unPrevProgramID );
+
+	ApplyConfigPlacement();
+	if ( src_window_id )
+		ApplyPlacementProfile();
+
+	SetupScene();
+	if ( mpv_video_loaded )
+		UpdateVideoRenderSize( true );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Runs the commands received on the control socket
+//-----------------------------------------------------------------------------
+void CMainApplication::HandleControlCommands()
+{
+	control_socket.take_commands( control_commands );
+	for ( const ControlCommand &command : control_commands )
+	{
+		control_socket.reply( command.client_id, HandleControlCommand( command.line ) );
+	}
+	control_commands.clear();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Runs one control socket command and returns the reply, which is
+//          "ok" followed by the result or "error" followed by the reason
+//-----------------------------------------------------------------------------
+std::string CMainApplication::HandleControlCommand( const std::string &command )
+{
+	const size_t name_end = command.find( ' ' );
+	const std::string name = command.substr( 0, name_end );
+	const std::string arg = name_end == std::string::npos ? std::string() : command.substr( name_end + 1 );
+
+	if ( name == "reset" )
+	{
+		ResetRotation();
+		return "ok";
+	}
+	else if ( name == "zoom" )
+	{
+		if ( arg == "in" )
+		{
+			zoom_in();
+		}
+		else if ( arg == "out" )
+		{
+			zoom_out();
+		}
+		else
+		{
+			char *endptr = nullptr;
+			const double value = strtod( arg.c_str(), &endptr );
+			if ( arg.empty() || *endptr != '\0' )
+				return "error zoom expects in, out or a number";
+			zoom = value;
+			zoom_resize = true;
+			save_zoom_state();
+		}
+		char reply[64];
+		snprintf( reply, sizeof( reply ), "ok %g", zoom );
+		return reply;
+	}
+	else if ( name == "seek" || name == "pause" || name == "load" || name == "append" )
+	{
+		if ( !mpv_file )
+			return "error " + name + " only works with --video";
+
+		if ( name == "seek" )
+		{
+			char *endptr = nullptr;
+			const double seconds = strtod( arg.c_str(), &endptr );
+			if ( arg.empty() || *endptr != '\0' )
+				return "error seek expects a number of seconds";
+			mpv.seek( seconds );
+		}
+		else if ( name == "pause" )
+		{
+			if ( arg.empty() || arg == "toggle" || ( arg == "yes" && !mpv.paused ) || ( arg == "no" && mpv.paused ) )
+				mpv.toggle_pause();
+			else if ( arg != "yes" && arg != "no" )
+				return "error pause expects yes, no or toggle";
+		}
+		else
+		{
+			if ( arg.empty() )
+				return "error " + name + " expects a path";
+			mpv.load_file( arg.c_str(), name == "append" );
+		}
+		return "ok";
+	}
+	else if ( name == "window" )
+	{
+		if ( mpv_file || follow_focused )
+			return "error window only works when viewing a window selected with window_id";
+
+		// Window ids are 32-bit XIDs. strtoul would also accept a negative number and wrap it around
+		char *endptr = nullptr;
+		errno = 0;
+		const unsigned long value = strtoul( arg.c_str(), &endptr, 0 );
+		if ( arg.empty() || arg[0] == '-' || *endptr != '\0' || errno == ERANGE || value > 0xFFFFFFFFUL )
+			return "error window expects a window id";
+
+		const Window window = value;
+		XWindowAttributes xwa;
+		if ( !window || !XGetWindowAttributes( x_display, window, &xwa ) )
+			return "error invalid window id";
+		if ( window != src_window_id )
+		{
+			src_window_id = window;
+			focused_window_changed = true;
+		}
+		return "ok";
+	}
+	else if ( name == "projection" )
+	{
+		if ( overlay_mode )
+			return "error the projection can't be changed in overlay mode";
+
+		ProjectionMode newProjectionMode;
+		if ( arg == "sphere" )
+			newProjectionMode = ProjectionMode::SPHERE;
+		else if ( arg == "flat" )
+			newProjectionMode = ProjectionMode::FLAT;
+		else if ( arg == "plane" )
+			newProjectionMode = ProjectionMode::CYLINDER;
+		else if ( arg == "sphere360" )
+			newProjectionMode = ProjectionMode::SPHERE360;
+		else if ( arg == "equirect180" )
+			newProjectionMode = ProjectionMode::EQUIRECT180;
+		else if ( arg == "equirect360" )
+			newProjectionMode = ProjectionMode::EQUIRECT360;
+		else
+			return "error projection expects sphere, flat, plane, sphere360, equirect180 or equirect360";
+
+		if ( !SetProjectionMode( newProjectionMode ) )
+			return "error failed to create the shader for the projection";
+		return "ok";
+	}
+	else if ( name == "stats" )
+	{
+		std::string reply = "ok";
+		string_append_format( reply, " projection=%s zoom=%g display_hz=%.2f", get_config_section( projection_mode ), zoom, m_fDisplayFrequency );
+		if ( mpv_file )
+		{
+			const MpvFrameStats &frame_stats = mpv.get_frame_stats();
+			string_append_format( reply, " video=%ldx%ld paused=%s dropped=%ld decoder_dropped=%ld delayed=%ld mistimed=%ld",
+				mpv_video_width, mpv_video_height, mpv.paused ? "yes" : "no",
+				frame_stats.dropped, frame_stats.decoder_dropped, frame_stats.delayed, frame_stats.mistimed );
+		}
+		else
+		{
+			string_append_format( reply, " window=%lu size=%dx%d", (unsigned long)src_window_id, window_width, window_height );
+		}
+		string_append_format( reply, " hidden_area=%.1f%%/%.1f%%", m_fHiddenAreaFraction[0] * 100.0f, m_fHiddenAreaFraction[1] * 100.0f );
+		if ( !overlay_mode )
+			string_append_format( reply, " mono_render=%s native_layer=%s", m_bMonoFrame ? "yes" : "no", m_bNativeLayerFrame ? "yes" : "no" );
+		if ( !overlay_mode )
+			string_append_format( reply, " pose_to_submit_ms=%.2f pose_wait_to_submit_ms=%.2f", pose_to_submit_ms, pose_wait_to_submit_ms );
+		string_append_format( reply, " gl_calls=%u gl_calls_skipped=%u", gl_state_frame_counters.issued, gl_state_frame_counters.skipped );
+		if ( dynamic_resolution_enabled )
+			string_append_format( reply, " render_scale=%.2f render_size=%ux%u gpu_ms=%.2f", dynamic_resolution.get_scale(), m_nEyeViewportWidth, m_nEyeViewportHeight, dynamic_resolution.get_gpu_ms() );
+		return reply;
+	}
+
+	return "error unknown command " + name;
 }
 
 //-----------------------------------------------------------------------------
@@ -1864,164 +2840,127 @@ void CMainApplication::MouseButton(int button, bool down)
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Compiles a GL shader program and returns the handle. Returns 0 if
-//			the shader couldn't be compiled for some reason.
+// Purpose: Adds the scene program for the current view mode to shader_cache
 //-----------------------------------------------------------------------------
-GLuint CMainApplication::CompileGLShader( const char *pchShaderName, const char *pchVertexShader, const char *pchFragmentShader )
+void CMainApplication::AddSceneProgram( ShaderCache &shader_cache, GLuint &unProgramID )
 {
-	GLuint unProgramID = glCreateProgram();
-
-	GLuint nSceneVertexShader = glCreateShader(GL_VERTEX_SHADER);
-	glShaderSource( nSceneVertexShader, 1, &pchVertexShader, NULL);
-	glCompileShader( nSceneVertexShader );
-
-	GLint vShaderCompiled = GL_FALSE;
-	glGetShaderiv( nSceneVertexShader, GL_COMPILE_STATUS, &vShaderCompiled);
-	if ( vShaderCompiled != GL_TRUE)
-	{
-		dprintf("%s - Unable to compile vertex shader %d!\n", pchShaderName, nSceneVertexShader);
-		glDeleteProgram( unProgramID );
-		glDeleteShader( nSceneVertexShader );
-		return 0;
+	// The scene shader is specialized for the view mode and whether there is a cursor to draw. The view mode only changes
+	// when the projection is switched at runtime, which creates the program again
+	std::string scene_defines;
+	std::string scene_program_name = "Scene";
+	switch(view_mode) {
+		case ViewMode::LEFT_RIGHT: scene_defines += "#define VIEW_LEFT_RIGHT\n"; scene_program_name += "_LEFT_RIGHT"; break;
+		case ViewMode::RIGHT_LEFT: scene_defines += "#define VIEW_RIGHT_LEFT\n"; scene_program_name += "_RIGHT_LEFT"; break;
+		case ViewMode::TOP_BOTTOM: scene_defines += "#define VIEW_TOP_BOTTOM\n"; scene_program_name += "_TOP_BOTTOM"; break;
+		case ViewMode::PLANE:      scene_defines += "#define VIEW_PLANE\n";      scene_program_name += "_PLANE";      break;
+		case ViewMode::SPHERE360:  scene_defines += "#define VIEW_SPHERE360\n";  scene_program_name += "_SPHERE360";  break;
 	}
-	glAttachShader( unProgramID, nSceneVertexShader);
-	glDeleteShader( nSceneVertexShader ); // the program hangs onto this once it's attached
-
-	GLuint  nSceneFragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-	glShaderSource( nSceneFragmentShader, 1, &pchFragmentShader, NULL);
-	glCompileShader( nSceneFragmentShader );
 
-	GLint fShaderCompiled = GL_FALSE;
-	glGetShaderiv( nSceneFragmentShader, GL_COMPILE_STATUS, &fShaderCompiled);
-	if (fShaderCompiled != GL_TRUE)
-	{
-		dprintf("%s - Unable to compile fragment shader %d!\n", pchShaderName, nSceneFragmentShader );
-		glDeleteProgram( unProgramID );
-		glDeleteShader( nSceneFragmentShader );
-		return 0;	
+	if(is_equirect(projection_mode)) {
+		AddEquirectProgram(shader_cache, scene_defines, scene_program_name, unProgramID);
+		return;
 	}
 
-	glAttachShader( unProgramID, nSceneFragmentShader );
-	glDeleteShader( nSceneFragmentShader ); // the program hangs onto this once it's attached
-
-	glLinkProgram( unProgramID );
-
-	GLint programSuccess = GL_TRUE;
-	glGetProgramiv( unProgramID, GL_LINK_STATUS, &programSuccess);
-	if ( programSuccess != GL_TRUE )
-	{
-		dprintf("%s - Error linking program %d!\n", pchShaderName, unProgramID);
-		glDeleteProgram( unProgramID );
-		return 0;
+	if(!mpv_file) {
+		scene_defines += "#define CURSOR\n";
+		scene_program_name += "_CURSOR";
 	}
 
-	glUseProgram( unProgramID );
-	glUseProgram( 0 );
-
-	return unProgramID;
-}
-
-
-//-----------------------------------------------------------------------------
-// Purpose: Creates all the shaders used by HelloVR SDL
-//-----------------------------------------------------------------------------
-bool CMainApplication::CreateAllShaders()
-{
-	m_unSceneProgramID = CompileGLShader( 
-		"Scene",
-
-		// Vertex Shader
-		"#version 410\n"
-		"uniform mat4 matrix;\n"
-		"uniform float texture_offset_x;\n"
-		"uniform float texture_scale_x;\n"
+	const std::string scene_vertex_shader =
+		"#version 410 core\n"
+		+ scene_defines +
+		"layout(std140) uniform EyeUniforms\n"
+		"{\n"
+		"	mat4 matrix;\n"
+		"	int eye;\n"
+		"};\n"
+		"#if defined(VIEW_LEFT_RIGHT)\n"
+		"const vec2 texture_scale = vec2(0.5, 1.0);\n"
+		"vec2 eye_texture_offset() { return vec2(0.5 * float(eye), 0.0); }\n"
+		"#elif defined(VIEW_RIGHT_LEFT)\n"
+		"const vec2 texture_scale = vec2(0.5, 1.0);\n"
+		"vec2 eye_texture_offset() { return vec2(0.5 * float(1 - eye), 0.0); }\n"
+		"#elif defined(VIEW_TOP_BOTTOM)\n"
+		"const vec2 texture_scale = vec2(1.0, 0.5);\n"
+		"vec2 eye_texture_offset() { return vec2(0.0, 0.5 * float(eye)); }\n"
+		"#else\n"
+		"const vec2 texture_scale = vec2(1.0, 1.0);\n"
+		"vec2 eye_texture_offset() { return vec2(0.0, 0.0); }\n"
+		"#endif\n"
+		"#ifdef CURSOR\n"
 		"uniform vec2 cursor_location;\n"
 		"uniform vec2 arrow_size;\n"
+		"out vec2 v2CursorLocation;\n"
+		"out vec2 arrow_size_frag;\n"
+		"#endif\n"
 		"layout(location = 0) in vec4 position;\n"
 		"layout(location = 1) in vec2 v2UVcoordsIn;\n"
 		"layout(location = 2) in vec3 v3NormalIn;\n"
-		"out vec2 v2CursorLocation;\n"
-		"out vec2 arrow_size_frag;\n"
 		"out vec2 v2UVcoords;\n"
 		"void main()\n"
 		"{\n"
-		"	v2UVcoords = vec2(1.0 - v2UVcoordsIn.x, v2UVcoordsIn.y) * vec2(texture_scale_x, 1.0) + vec2(texture_offset_x, 0.0);\n"
+		"	vec2 texture_offset = eye_texture_offset();\n"
+		"	v2UVcoords = vec2(1.0 - v2UVcoordsIn.x, v2UVcoordsIn.y) * texture_scale + texture_offset;\n"
 		"   vec4 inverse_pos = vec4(position.x, position.y, -position.z, position.w);\n"
-		"	v2CursorLocation = cursor_location;\n"
+		"#ifdef CURSOR\n"
+		"	v2CursorLocation = cursor_location + texture_offset;\n"
 		"	arrow_size_frag = arrow_size;\n"
+		"#endif\n"
 		"	gl_Position = matrix * inverse_pos;\n"
-		"}\n",
+		"}\n";
 
-		// Fragment Shader
+	const std::string scene_fragment_shader =
 		"#version 410 core\n"
+		+ scene_defines +
 		"uniform sampler2D mytexture;\n"
+		"#ifdef CURSOR\n"
 		"uniform sampler2D arrow_texture;\n"
-		"in vec2 v2UVcoords;\n"
 		"in vec2 v2CursorLocation;\n"
 		"in vec2 arrow_size_frag;\n"
+		"#endif\n"
+		"in vec2 v2UVcoords;\n"
 		"out vec4 outputColor;\n"
 		"void main()\n"
 		"{\n"
+		"	vec4 col = texture(mytexture, v2UVcoords);\n"
+		"#ifdef CURSOR\n"
 		"	vec2 cursor_diff = (v2CursorLocation + arrow_size_frag) - v2UVcoords;\n"
 		"	vec2 arrow_coord = (arrow_size_frag - cursor_diff) / arrow_size_frag;\n"
 		"	vec4 arrow_col = texture(arrow_texture, arrow_coord);\n"
-		"	vec4 col = texture(mytexture, v2UVcoords);\n"
 		"	if(arrow_size_frag.x < 0.01 || arrow_size_frag.y < 0.01 || arrow_coord.x < 0.0 || arrow_coord.x > 1.0 || arrow_coord.y < 0.0 || arrow_coord.y > 1.0) arrow_col.a = 0.0;\n"
-		"	outputColor = mix(col, arrow_col.bgra, arrow_col.a);\n"
-		"}\n"
-		);
-	m_nSceneMatrixLocation = glGetUniformLocation( m_unSceneProgramID, "matrix" );
-	if( m_nSceneMatrixLocation == -1 )
-	{
-		dprintf( "Unable to find matrix uniform in scene shader\n" );
-		return false;
-	}
-	m_nSceneTextureOffsetXLocation = glGetUniformLocation( m_unSceneProgramID, "texture_offset_x" );
-	if( m_nSceneTextureOffsetXLocation == -1 )
-	{
-		dprintf( "Unable to find texture_offset_x uniform in scene shader\n" );
-		return false;
-	}
-	m_nSceneTextureScaleXLocation = glGetUniformLocation( m_unSceneProgramID, "texture_scale_x" );
-	if( m_nSceneTextureScaleXLocation == -1 )
-	{
-		dprintf( "Unable to find texture_scale_x uniform in scene shader\n" );
-		return false;
-	}
-	m_nCursorLocation = glGetUniformLocation( m_unSceneProgramID, "cursor_location" );
-	if( m_nCursorLocation == -1 )
-	{
-		dprintf( "Unable to find cursor_location uniform in scene shader\n" );
-		return false;
-	}
-	m_nArrowSizeLocation = glGetUniformLocation( m_unSceneProgramID, "arrow_size" );
-	if( m_nArrowSizeLocation == -1 )
-	{
-		dprintf( "Unable to find arrow_size uniform in scene shader\n" );
-		return false;
-	}
-	m_myTextureLocation = glGetUniformLocation(m_unSceneProgramID, "mytexture");
-	if(m_myTextureLocation == -1) {
-		dprintf( "Unable to find mytexture uniform in scene shader\n" );
-		return false;
-	}
-	m_arrowTextureLocation = glGetUniformLocation(m_unSceneProgramID, "arrow_texture");
-	if(m_arrowTextureLocation == -1) {
-		dprintf( "Unable to find arrow_texture uniform in scene shader\n" );
-		return false;
-	}
+		"	col = mix(col, arrow_col.bgra, arrow_col.a);\n"
+		"#endif\n"
+		// Transparent parts of 32-bit windows fade to black, like they did when the scene was blended over the black clear
+		"	outputColor = vec4(col.rgb * col.a, 1.0);\n"
+		"}\n";
 
-	m_unCompanionWindowProgramID = CompileGLShader(
+	shader_cache.add_program( scene_program_name.c_str(), scene_vertex_shader.c_str(), scene_fragment_shader.c_str(), unProgramID );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Creates all the shaders used by HelloVR SDL
+//-----------------------------------------------------------------------------
+bool CMainApplication::CreateAllShaders()
+{
+	ShaderCache shader_cache;
+	init_shader_cache( shader_cache );
+
+	// All programs are added before any of them is waited on, so that the driver can compile them in parallel
+	AddSceneProgram( shader_cache, m_unSceneProgramID );
+
+	shader_cache.add_program(
 		"CompanionWindow",
 
 		// vertex shader
 		"#version 410 core\n"
+		// Part of the eye targets that is rendered to, it's centered
+		"uniform vec2 uv_scale;\n"
 		"layout(location = 0) in vec4 position;\n"
 		"layout(location = 1) in vec2 v2UVIn;\n"
 		"noperspective out vec2 v2UV;\n"
 		"void main()\n"
 		"{\n"
-		"	v2UV = vec2(v2UVIn.x, 1.0 - v2UVIn.y);\n"
+		"	v2UV = (vec2(v2UVIn.x, 1.0 - v2UVIn.y) - 0.5) * uv_scale + 0.5;\n"
 		"	gl_Position = position;\n"
 		"}\n",
 
@@ -2034,40 +2973,179 @@ bool CMainApplication::CreateAllShaders()
 		"{\n"
 		"	vec4 col = texture(mytexture, v2UV);\n"
 		"	outputColor = col.rgba;\n"
-		"}\n"
+		"}\n",
+		m_unCompanionWindowProgramID
 		);
 
-	m_unOverlayProgramID = CompileGLShader(
-		"OverlayProgram",
+	shader_cache.add_program(
+		"HiddenArea",
 
 		// vertex shader
 		"#version 410 core\n"
-		"layout(location = 0) in vec4 position;\n"
-		"layout(location = 1) in vec2 v2UVIn;\n"
-		"noperspective out vec2 v2UV;\n"
+		"layout(location = 0) in vec2 position;\n"
 		"void main()\n"
 		"{\n"
-		"	v2UV = vec2(v2UVIn.x, 1.0 - v2UVIn.y);\n"
-		"	gl_Position = vec4(2.0 * position.x + 1.0, position.yzw);\n"
+		// The mesh is in texture coordinates of the eye's image with v=0 at the top. It's put on the near plane so it's in front of everything in the scene
+		"	gl_Position = vec4(position.x * 2.0 - 1.0, 1.0 - position.y * 2.0, -1.0, 1.0);\n"
 		"}\n",
 
-		// fragment shader
+		// fragment shader, only the depth is written
 		"#version 410 core\n"
-		"uniform sampler2D mytexture;\n"
-		"noperspective in vec2 v2UV;\n"
-		"out vec4 outputColor;\n"
 		"void main()\n"
 		"{\n"
-		"	vec4 col = texture(mytexture, v2UV);\n"
-		"	outputColor = col.rgba;\n"
-		"}\n"
+		"}\n",
+		m_unHiddenAreaProgramID
 		);
 
-	m_unOverlayTextureLoc = glGetUniformLocation(m_unOverlayProgramID, "mytexture");
+	if( !shader_cache.finish_programs() )
+		return false;
+
+	if( !InitSceneProgram() )
+		return false;
+
+	m_nCompanionUVScaleLocation = glGetUniformLocation(m_unCompanionWindowProgramID, "uv_scale");
 
 	return m_unSceneProgramID != 0 
 		&& m_unCompanionWindowProgramID != 0 &&
-		m_unOverlayProgramID != 0;
+		m_unHiddenAreaProgramID != 0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Adds the scene program of the equirectangular projections. It draws
+//          a single triangle that covers the eye's view and computes the
+//          texture coordinates of every fragment from its view direction
+//-----------------------------------------------------------------------------
+void CMainApplication::AddEquirectProgram( ShaderCache &shader_cache, std::string scene_defines, std::string scene_program_name, GLuint &unProgramID )
+{
+	if(projection_mode == ProjectionMode::EQUIRECT360) {
+		scene_defines += "#define EQUIRECT360\n";
+		scene_program_name += "_EQUIRECT360";
+	} else {
+		scene_program_name += "_EQUIRECT180";
+	}
+
+	const std::string uniforms =
+		"layout(std140) uniform EyeUniforms\n"
+		"{\n"
+		"	mat4 matrix;\n"
+		"	int eye;\n"
+		"	mat4 inverse_matrix;\n"
+		"};\n";
+
+	const std::string vertex_shader =
+		"#version 410 core\n"
+		+ scene_defines + uniforms +
+		"noperspective out vec4 v4Near;\n"
+		"noperspective out vec4 v4Far;\n"
+		"void main()\n"
+		"{\n"
+		"	vec2 position = vec2(float((gl_VertexID & 1) << 2) - 1.0, float((gl_VertexID & 2) << 1) - 1.0);\n"
+		// Homogeneous points are linear in screen space, so they can be interpolated and only divided per fragment
+		"	v4Near = inverse_matrix * vec4(position, -1.0, 1.0);\n"
+		"	v4Far = inverse_matrix * vec4(position, 1.0, 1.0);\n"
+		"	gl_Position = vec4(position, 0.0, 1.0);\n"
+		"}\n";
+
+	const std::string fragment_shader =
+		"#version 410 core\n"
+		+ scene_defines + uniforms +
+		"uniform sampler2D mytexture;\n"
+		"noperspective in vec4 v4Near;\n"
+		"noperspective in vec4 v4Far;\n"
+		"out vec4 outputColor;\n"
+		"const float PI = 3.14159265358979;\n"
+		"void main()\n"
+		"{\n"
+		"	vec3 direction = normalize(v4Far.xyz / v4Far.w - v4Near.xyz / v4Near.w);\n"
+		// The scene flips z, so forward is -z and the center of the video is straight ahead
+		"	float longitude = atan(direction.x, -direction.z);\n"
+		"	float latitude = asin(clamp(direction.y, -1.0, 1.0));\n"
+		"#ifdef EQUIRECT360\n"
+		"	vec2 uv = vec2(longitude / (2.0 * PI) + 0.5, 0.5 - latitude / PI);\n"
+		"#else\n"
+		"	vec2 uv = vec2(longitude / PI + 0.5, 0.5 - latitude / PI);\n"
+		"#endif\n"
+		// The longitude wraps around behind the viewer, the derivatives across the wrap are corrected so they don't select the smallest mip level
+		"	vec2 uv_dx = dFdx(uv);\n"
+		"	vec2 uv_dy = dFdy(uv);\n"
+		"	uv_dx.x -= round(uv_dx.x);\n"
+		"	uv_dy.x -= round(uv_dy.x);\n"
+		"#if defined(VIEW_LEFT_RIGHT)\n"
+		"	uv = vec2(uv.x * 0.5 + 0.5 * float(eye), uv.y);\n"
+		"	const vec2 layout_scale = vec2(0.5, 1.0);\n"
+		"#elif defined(VIEW_RIGHT_LEFT)\n"
+		"	uv = vec2(uv.x * 0.5 + 0.5 * float(1 - eye), uv.y);\n"
+		"	const vec2 layout_scale = vec2(0.5, 1.0);\n"
+		"#elif defined(VIEW_TOP_BOTTOM)\n"
+		"	uv = vec2(uv.x, uv.y * 0.5 + 0.5 * float(eye));\n"
+		"	const vec2 layout_scale = vec2(1.0, 0.5);\n"
+		"#else\n"
+		"	const vec2 layout_scale = vec2(1.0, 1.0);\n"
+		"#endif\n"
+		"	vec4 col = textureGrad(mytexture, uv, uv_dx * layout_scale, uv_dy * layout_scale);\n"
+		// Transparent parts of 32-bit windows fade to black, like in the other scene shader
+		"	outputColor = vec4(col.rgb * col.a, 1.0);\n"
+		// Behind the viewer is black. Not returning early, the derivatives above need all fragments of a quad
+		"#ifndef EQUIRECT360\n"
+		"	if(abs(longitude) > 0.5 * PI)\n"
+		"		outputColor = vec4(0.0, 0.0, 0.0, 1.0);\n"
+		"#endif\n"
+		"}\n";
+
+	shader_cache.add_program( scene_program_name.c_str(), vertex_shader.c_str(), fragment_shader.c_str(), unProgramID );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Looks up the uniforms of the scene program and binds its textures
+//          and uniform block
+//-----------------------------------------------------------------------------
+bool CMainApplication::InitSceneProgram()
+{
+	GLuint unEyeUniformsIndex = glGetUniformBlockIndex( m_unSceneProgramID, "EyeUniforms" );
+	if( unEyeUniformsIndex == GL_INVALID_INDEX )
+	{
+		dprintf( "Unable to find EyeUniforms uniform block in scene shader\n" );
+		return false;
+	}
+	glUniformBlockBinding( m_unSceneProgramID, unEyeUniformsIndex, 0 );
+
+	m_myTextureLocation = glGetUniformLocation(m_unSceneProgramID, "mytexture");
+	if(m_myTextureLocation == -1) {
+		dprintf( "Unable to find mytexture uniform in scene shader\n" );
+		return false;
+	}
+
+	// The cursor uniforms only exist in the variant with a cursor, setting them is a no-op otherwise
+	if(!mpv_file && !is_equirect(projection_mode)) {
+		m_nCursorLocation = glGetUniformLocation( m_unSceneProgramID, "cursor_location" );
+		if( m_nCursorLocation == -1 )
+		{
+			dprintf( "Unable to find cursor_location uniform in scene shader\n" );
+			return false;
+		}
+		m_nArrowSizeLocation = glGetUniformLocation( m_unSceneProgramID, "arrow_size" );
+		if( m_nArrowSizeLocation == -1 )
+		{
+			dprintf( "Unable to find arrow_size uniform in scene shader\n" );
+			return false;
+		}
+		m_arrowTextureLocation = glGetUniformLocation(m_unSceneProgramID, "arrow_texture");
+		if(m_arrowTextureLocation == -1) {
+			dprintf( "Unable to find arrow_texture uniform in scene shader\n" );
+			return false;
+		}
+	} else {
+		// Locations of a previous program could be other uniforms in this one
+		m_nCursorLocation = -1;
+		m_nArrowSizeLocation = -1;
+		m_arrowTextureLocation = -1;
+	}
+
+	glUseProgram( m_unSceneProgramID );
+	glUniform1i(m_myTextureLocation, 0);
+	glUniform1i(m_arrowTextureLocation, 1);
+	glUseProgram( 0 );
+	return true;
 }
 
 bool CMainApplication::SetCursorFromX11CursorImage(XFixesCursorImage *x11_cursor_image) {
@@ -2143,7 +3221,92 @@ Window CMainApplication::get_focused_window() {
 	return None;
 }
 
-void CMainApplication::save_config() {
+std::string CMainApplication::get_window_title(Window window) {
+	std::string title;
+	Atom type;
+	int format = 0;
+	unsigned long num_items = 0;
+	unsigned long bytes_after = 0;
+	unsigned char *properties = nullptr;
+	if(XGetWindowProperty(x_display, window, net_wm_name_atom, 0, 1024, False, utf8_string_atom, &type, &format, &num_items, &bytes_after, &properties) == Success && properties) {
+		// The property is returned with its actual type when it doesn't match the requested one
+		const bool is_utf8_title = type == utf8_string_atom && num_items > 0;
+		if(is_utf8_title)
+			title.assign((const char*)properties, num_items);
+		XFree(properties);
+		if(is_utf8_title)
+			return title;
+	}
+
+	char *name = nullptr;
+	if(XFetchName(x_display, window, &name) && name) {
+		title = name;
+		XFree(name);
+	}
+	return title;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Restores the placement that was last used for the application of
+// the source window, if there is one
+//-----------------------------------------------------------------------------
+void CMainApplication::ApplyPlacementProfile() {
+	std::string wm_class;
+	XClassHint class_hint = { nullptr, nullptr };
+	if(XGetClassHint(x_display, src_window_id, &class_hint)) {
+		if(class_hint.res_class)
+			wm_class = class_hint.res_class;
+		XFree(class_hint.res_name);
+		XFree(class_hint.res_class);
+	}
+
+	const PlacementProfile *profile = placement_profiles.find(get_config_section(projection_mode), wm_class, get_window_title(src_window_id), placement_profile_match);
+	const bool first_window = !placement_profile_checked;
+	placement_profile_checked = true;
+	if(!profile) {
+		// Otherwise the window would keep the placement of the previous window
+		if(!first_window)
+			ApplyConfigPlacement();
+		return;
+	}
+
+	fprintf(stderr, "Using placement profile %s\n", placement_profile_match.c_str());
+	if(free_camera)
+		hmd_pos = profile->position;
+	m_reset_rotation = profile->rotation;
+	zoom = profile->zoom;
+}
+
+void CMainApplication::SavePlacementProfile() {
+	PlacementProfile profile;
+	profile.position = hmd_pos;
+	profile.rotation = m_reset_rotation;
+	profile.zoom = zoom;
+	// Without --free-camera the position follows the hmd every frame and means nothing
+	placement_profiles.save(get_config_section(projection_mode), placement_profile_match, profile, free_camera, state_writer);
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Sets the placement of the current projection mode from the config
+//          file, with the same defaults as on startup
+//-----------------------------------------------------------------------------
+void CMainApplication::ApplyConfigPlacement() {
+	const bool zoom_unused = projection_mode == ProjectionMode::SPHERE360 || is_equirect(projection_mode);
+	zoom = (projection_mode == ProjectionMode::SPHERE || zoom_unused) ? 0.0 : 1.0;
+	if(!config_exists)
+		return;
+
+	glm::vec3 pos;
+	float saved_zoom = 0.0f;
+	get_config_values(config, projection_mode, pos, m_reset_rotation, saved_zoom);
+	if(free_camera)
+		hmd_pos = pos;
+	if(!zoom_unused)
+		zoom = saved_zoom;
+}
+
+// Stores the placement of the current projection mode in |config|
+void CMainApplication::store_config_values() {
 	if(free_camera) {
 		switch(projection_mode) {
 			case ProjectionMode::SPHERE: {
@@ -2162,6 +3325,14 @@ void CMainApplication::save_config() {
 				config.sphere360.position = hmd_pos;
 				break;
 			}
+			case ProjectionMode::EQUIRECT180: {
+				config.equirect180.position = hmd_pos;
+				break;
+			}
+			case ProjectionMode::EQUIRECT360: {
+				config.equirect360.position = hmd_pos;
+				break;
+			}
 		}
 	}
 	switch(projection_mode) {
@@ -2185,10 +3356,73 @@ void CMainApplication::save_config() {
 			config.sphere360.zoom = zoom;
 			break;
 		}
+		case ProjectionMode::EQUIRECT180: {
+			config.equirect180.rotation = m_reset_rotation;
+			config.equirect180.zoom = zoom;
+			break;
+		}
+		case ProjectionMode::EQUIRECT360: {
+			config.equirect360.rotation = m_reset_rotation;
+			config.equirect360.zoom = zoom;
+			break;
+		}
+	}
+}
+
+void CMainApplication::save_config() {
+	store_config_values();
+	state_writer.write(get_config_path(), config_to_string(config));
+}
+
+
+// Splits the mesh into patches of SCENE_PATCH_VERTICES vertices and computes their bounds the way the scene shader sees the vertices, with z flipped
+static void build_scene_patches( const std::vector<float> &vertdata, std::vector<ScenePatch> &patches )
+{
+	patches.clear();
+	const GLsizei num_vertices = vertdata.size() / 5;
+	for( GLint first = 0; first < num_vertices; first += SCENE_PATCH_VERTICES )
+	{
+		ScenePatch patch;
+		patch.first = first;
+		patch.count = std::min( (GLsizei)SCENE_PATCH_VERTICES, num_vertices - first );
+		patch.boundsMin = glm::vec3( FLT_MAX );
+		patch.boundsMax = glm::vec3( -FLT_MAX );
+		for( GLsizei i = 0; i < patch.count; ++i )
+		{
+			const float *vertex = &vertdata[( first + i ) * 5];
+			const glm::vec3 position( vertex[0], vertex[1], -vertex[2] );
+			patch.boundsMin = glm::min( patch.boundsMin, position );
+			patch.boundsMax = glm::max( patch.boundsMax, position );
+		}
+		patches.push_back( patch );
 	}
-	::save_config(config);
 }
 
+// Returns true if all corners of the bounds are outside of the same clip plane. Bounds that intersect the frustum
+// only diagonally are kept, which is conservative
+static bool scene_patch_outside_frustum( const glm::mat4 &matrix, const ScenePatch &patch )
+{
+	glm::vec4 corners[8];
+	for( int i = 0; i < 8; ++i )
+	{
+		const glm::vec3 corner( ( i & 1 ) ? patch.boundsMax.x : patch.boundsMin.x, ( i & 2 ) ? patch.boundsMax.y : patch.boundsMin.y, ( i & 4 ) ? patch.boundsMax.z : patch.boundsMin.z );
+		corners[i] = matrix * glm::vec4( corner, 1.0f );
+	}
+
+	for( int axis = 0; axis < 3; ++axis )
+	{
+		bool all_below = true;
+		bool all_above = true;
+		for( const glm::vec4 &corner : corners )
+		{
+			all_below = all_below && corner[axis] < -corner.w;
+			all_above = all_above && corner[axis] > corner.w;
+		}
+		if( all_below || all_above )
+			return true;
+	}
+	return false;
+}
 
 //-----------------------------------------------------------------------------
 // Purpose: create a sea of cubes
@@ -2198,6 +3432,14 @@ void CMainApplication::SetupScene()
 	if ( !m_pHMD )
 		return;
 
+	// The equirectangular projections don't have a mesh, see AddEquirectProgram
+	if ( is_equirect( projection_mode ) )
+	{
+		m_uiVertcount = 0;
+		m_scenePatches.clear();
+		return;
+	}
+
 	std::vector<float> vertdataarray;
 #if 0
 	glm::mat4 matScale =glm::scale(glm::mat4(1.0f), glm::vec3(m_fScale, m_fScale, m_fScale));
@@ -2238,6 +3480,7 @@ void CMainApplication::SetupScene()
 	AddCubeToScene( mat, vertdataarray );
 #endif
 	m_uiVertcount = vertdataarray.size()/5;
+	build_scene_patches( vertdataarray, m_scenePatches );
 	
 	glBindVertexArray( m_unSceneVAO );
 	glBindBuffer( GL_ARRAY_BUFFER, m_glSceneVertBuffer );
@@ -2473,9 +3716,9 @@ void CMainApplication::AddCubeToScene( const glm::mat4 &mat, std::vector<float>
 	else if (projection_mode == ProjectionMode::CYLINDER)
 	{
 		long columns = 64;
-		double angle_start = -0.8;
-		double angle_end = 0.8;
-		double height = 1.5;
+		double angle_start = -PLANE_HALF_ANGLE;
+		double angle_end = PLANE_HALF_ANGLE;
+		double height = PLANE_HALF_HEIGHT;
 		double angle_len = angle_end - angle_start;
 
 		double width_start = sin(angle_start);
@@ -2488,9 +3731,9 @@ void CMainApplication::AddCubeToScene( const glm::mat4 &mat, std::vector<float>
 			double t2 = (((double)column + 1) / (double)columns);
 
 			double x1 = sin(angle_start + t1 * angle_len) * radius;
-			double y1 = cos(angle_start + t1 * angle_len) * radius * 0.6;
+			double y1 = cos(angle_start + t1 * angle_len) * radius * PLANE_DEPTH_SCALE;
 			double x2 = sin(angle_start + t2 * angle_len) * radius;
-			double y2 = cos(angle_start + t2 * angle_len) * radius * 0.6;
+			double y2 = cos(angle_start + t2 * angle_len) * radius * PLANE_DEPTH_SCALE;
 
 			//     2     n
 			// 1  /|   / |    m
@@ -2507,7 +3750,7 @@ void CMainApplication::AddCubeToScene( const glm::mat4 &mat, std::vector<float>
 			AddCubeVertex(x2, -height, zoom + y2, 1 - t2, 1, vertdata);
 		}
 	} else if (projection_mode == ProjectionMode::FLAT) {
-		double height = 0.5;
+		double height = FLAT_HALF_HEIGHT;
 		double width = height * (stretch ? 1.0 : 0.5) * width_ratio;
 		AddCubeVertex(-width, 	 height, zoom, 1.0, 0.0, vertdata);
 		AddCubeVertex(width, 	 height, zoom, 0.0, 0.0, vertdata);
@@ -2572,6 +3815,76 @@ void CMainApplication::SetupCameras()
 	m_mat4ProjectionRight = GetHMDMatrixProjectionEye( vr::Eye_Right );
 	m_mat4eyePosLeft = GetHMDMatrixPoseEye( vr::Eye_Left );
 	m_mat4eyePosRight = GetHMDMatrixPoseEye( vr::Eye_Right );
+	SetupMonoCamera();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Sets up the projection and size of the mono target, which covers
+//          the fields of view of both eyes at the pixel density of the eye
+//          targets
+//-----------------------------------------------------------------------------
+void CMainApplication::SetupMonoCamera()
+{
+	m_bMonoPossible = false;
+	if ( !m_pHMD || overlay_mode )
+		return;
+
+	// The eyes can only share an image if they look in the same direction
+	for ( int i = 0; i < 3; ++i )
+	{
+		for ( int j = 0; j < 3; ++j )
+		{
+			const float fIdentity = i == j ? 1.0f : 0.0f;
+			if ( fabsf( m_mat4eyePosLeft[i][j] - fIdentity ) > 0.0001f || fabsf( m_mat4eyePosRight[i][j] - fIdentity ) > 0.0001f )
+				return;
+		}
+	}
+
+	// Tangents of the edges of each eye's field of view, taken from the projection matrices so that they follow the same conventions
+	const glm::mat4 *pProjections[2] = { &m_mat4ProjectionLeft, &m_mat4ProjectionRight };
+	float fLeft[2], fRight[2], fDown[2], fUp[2];
+	for ( int nEyeIndex = 0; nEyeIndex < 2; ++nEyeIndex )
+	{
+		const glm::mat4 &proj = *pProjections[nEyeIndex];
+		if ( proj[0][0] <= 0.0f || proj[1][1] <= 0.0f )
+			return;
+		fLeft[nEyeIndex] = ( proj[2][0] - 1.0f ) / proj[0][0];
+		fRight[nEyeIndex] = ( proj[2][0] + 1.0f ) / proj[0][0];
+		fDown[nEyeIndex] = ( proj[2][1] - 1.0f ) / proj[1][1];
+		fUp[nEyeIndex] = ( proj[2][1] + 1.0f ) / proj[1][1];
+	}
+
+	const float fUnionLeft = std::min( fLeft[0], fLeft[1] );
+	const float fUnionRight = std::max( fRight[0], fRight[1] );
+	const float fUnionDown = std::min( fDown[0], fDown[1] );
+	const float fUnionUp = std::max( fUp[0], fUp[1] );
+	const float fUnionWidth = fUnionRight - fUnionLeft;
+	const float fUnionHeight = fUnionUp - fUnionDown;
+
+	// Same depth mapping as the eyes
+	m_mat4ProjectionMono = m_mat4ProjectionLeft;
+	m_mat4ProjectionMono[0][0] = 2.0f / fUnionWidth;
+	m_mat4ProjectionMono[2][0] = ( fUnionRight + fUnionLeft ) / fUnionWidth;
+	m_mat4ProjectionMono[1][1] = 2.0f / fUnionHeight;
+	m_mat4ProjectionMono[2][1] = ( fUnionUp + fUnionDown ) / fUnionHeight;
+
+	for ( int nEyeIndex = 0; nEyeIndex < 2; ++nEyeIndex )
+	{
+		m_monoEyeBounds[nEyeIndex].uMin = ( fLeft[nEyeIndex] - fUnionLeft ) / fUnionWidth;
+		m_monoEyeBounds[nEyeIndex].uMax = ( fRight[nEyeIndex] - fUnionLeft ) / fUnionWidth;
+		m_monoEyeBounds[nEyeIndex].vMin = ( fUnionUp - fUp[nEyeIndex] ) / fUnionHeight;
+		m_monoEyeBounds[nEyeIndex].vMax = ( fUnionUp - fDown[nEyeIndex] ) / fUnionHeight;
+	}
+
+	// The recommended size is for the eye with the narrowest field of view, so that the pixel density is at least as high as the eye targets
+	m_pHMD->GetRecommendedRenderTargetSize( &m_nRenderWidth, &m_nRenderHeight );
+	const float fEyeWidth = std::min( fRight[0] - fLeft[0], fRight[1] - fLeft[1] );
+	const float fEyeHeight = std::min( fUp[0] - fDown[0], fUp[1] - fDown[1] );
+	const float fMaxScale = dynamic_resolution_enabled ? DYNAMIC_RESOLUTION_MAX_SCALE : 1.0f;
+	m_nMonoTargetWidth = (uint32_t)( m_nRenderWidth * fMaxScale * fUnionWidth / fEyeWidth );
+	m_nMonoTargetHeight = (uint32_t)( m_nRenderHeight * fMaxScale * fUnionHeight / fEyeHeight );
+	m_bMonoPossible = true;
 }
 
 
@@ -2579,15 +3892,28 @@ void CMainApplication::SetupCameras()
 // Purpose: Creates a frame buffer. Returns true if the buffer was set up.
 //          Returns false if the setup failed.
 //-----------------------------------------------------------------------------
-bool CMainApplication::CreateFrameBuffer( int nWidth, int nHeight, FramebufferDesc &framebufferDesc )
+bool CMainApplication::CreateFrameBuffer( int nWidth, int nHeight, bool bHiddenArea, FramebufferDesc &framebufferDesc )
 {
 	glGenFramebuffers(1, &framebufferDesc.m_nRenderFramebufferId );
 	glBindFramebuffer(GL_FRAMEBUFFER, framebufferDesc.m_nRenderFramebufferId);
 
-	glGenRenderbuffers(1, &framebufferDesc.m_nDepthBufferId);
-	glBindRenderbuffer(GL_RENDERBUFFER, framebufferDesc.m_nDepthBufferId);
-	glRenderbufferStorageMultisample(GL_RENDERBUFFER, 4, GL_DEPTH_COMPONENT, nWidth, nHeight );
-	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER,	framebufferDesc.m_nDepthBufferId );
+	// The scene is one surface that never overlaps itself, so with --lean-targets the depth buffer is only replaced by a
+	// stencil buffer when the hidden area has to be masked, see RenderScene
+	framebufferDesc.m_nDepthBufferId = 0;
+	if ( !lean_targets )
+	{
+		glGenRenderbuffers(1, &framebufferDesc.m_nDepthBufferId);
+		glBindRenderbuffer(GL_RENDERBUFFER, framebufferDesc.m_nDepthBufferId);
+		glRenderbufferStorageMultisample(GL_RENDERBUFFER, 4, GL_DEPTH_COMPONENT, nWidth, nHeight );
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER,	framebufferDesc.m_nDepthBufferId );
+	}
+	else if ( bHiddenArea )
+	{
+		glGenRenderbuffers(1, &framebufferDesc.m_nDepthBufferId);
+		glBindRenderbuffer(GL_RENDERBUFFER, framebufferDesc.m_nDepthBufferId);
+		glRenderbufferStorageMultisample(GL_RENDERBUFFER, 4, GL_STENCIL_INDEX8, nWidth, nHeight );
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_STENCIL_ATTACHMENT, GL_RENDERBUFFER, framebufferDesc.m_nDepthBufferId );
+	}
 
 	glGenTextures(1, &framebufferDesc.m_nRenderTextureId );
 	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, framebufferDesc.m_nRenderTextureId );
@@ -2600,6 +3926,9 @@ bool CMainApplication::CreateFrameBuffer( int nWidth, int nHeight, FramebufferDe
 	glGenTextures(1, &framebufferDesc.m_nResolveTextureId );
 	glBindTexture(GL_TEXTURE_2D, framebufferDesc.m_nResolveTextureId );
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, nWidth, nHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, framebufferDesc.m_nResolveTextureId, 0);
@@ -2616,42 +3945,312 @@ bool CMainApplication::CreateFrameBuffer( int nWidth, int nHeight, FramebufferDe
 	return true;
 }
 
-void CMainApplication::set_current_context(SDL_GLContext context) {
-	std::lock_guard<std::mutex> lock(context_mutex);
-	SDL_GL_MakeCurrent(m_pCompanionWindow, context);
-}
-
-bool CMainApplication::take_render_update() {
+// Blocks the mpv thread until it has something to do: a new vr frame to render for while RENDERING, or stopping.
+// Nothing wakes it up while it's WAITING_FOR_VIDEO. |render_updates| is set to the number of new mpv frames since the last call.
+// Returns the state to handle, which is never WAITING_FOR_VIDEO
+MpvThreadState CMainApplication::wait_mpv_thread_work(uint64_t &last_display_vsync, int &render_updates) {
 	std::unique_lock<std::mutex> lock(mpv_render_update_mutex);
-	while(!mpv_render_update && running)
-	{
-		mpv_render_update_condition.wait(lock);
+	mpv_render_update_condition.wait(lock, [&] {
+		const MpvThreadState state = mpv_thread_state.load();
+		return state == MpvThreadState::STOPPING || (state == MpvThreadState::RENDERING && display_vsync_counter != last_display_vsync);
+	});
+
+	const MpvThreadState state = mpv_thread_state.load();
+	if(state == MpvThreadState::RENDERING) {
+		last_display_vsync = display_vsync_counter;
+		render_updates = mpv_render_updates;
+		mpv_render_updates = 0;
 	}
-	mpv_render_update = false;
+	return state;
+}
+
+void CMainApplication::set_mpv_thread_state(MpvThreadState state) {
+	std::lock_guard<std::mutex> lock(mpv_render_update_mutex);
+	// Nothing comes after stopping
+	if(mpv_thread_state.load() == MpvThreadState::STOPPING)
+		return;
+	mpv_thread_state.store(state);
+	mpv_render_update_condition.notify_one();
+}
+
+void CMainApplication::request_video_resize(int64_t width, int64_t height) {
+	std::lock_guard<std::mutex> lock(mpv_render_update_mutex);
+	mpv_video_resize = true;
+	mpv_video_resize_width = width;
+	mpv_video_resize_height = height;
+}
+
+bool CMainApplication::take_video_resize(int64_t &width, int64_t &height) {
+	std::lock_guard<std::mutex> lock(mpv_render_update_mutex);
+	if(!mpv_video_resize)
+		return false;
+	mpv_video_resize = false;
+	width = mpv_video_resize_width;
+	height = mpv_video_resize_height;
 	return true;
 }
 
+// mpv frames are only rendered on the next vr frame so this doesn't wake up the mpv thread
 void CMainApplication::set_render_update() {
 	std::lock_guard<std::mutex> lock(mpv_render_update_mutex);
-	mpv_render_update = true;
-	mpv_render_update_condition.notify_one();
+	++mpv_render_updates;
+}
+
+void CMainApplication::signal_display_vsync() {
+	std::lock_guard<std::mutex> lock(mpv_render_update_mutex);
+	++display_vsync_counter;
+	if(mpv_thread_state.load() == MpvThreadState::RENDERING)
+		mpv_render_update_condition.notify_one();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Computes the size the video should be rendered at. Rendering at the
+//          full source size is wasted when the headset can't resolve that many
+//          texels at the angular size the video is shown at, so mpv scales the
+//          video straight to roughly one texel per eye buffer pixel instead.
+//-----------------------------------------------------------------------------
+void CMainApplication::GetVideoRenderSize( int64_t nVideoWidth, int64_t nVideoHeight, int64_t &nRenderWidth, int64_t &nRenderHeight )
+{
+	nRenderWidth = nVideoWidth;
+	nRenderHeight = nVideoHeight;
+
+	// The dashboard overlay size in view is not known
+	if ( mpv_full_resolution || overlay_mode || !m_pHMD || nVideoWidth <= 0 || nVideoHeight <= 0 )
+		return;
+
+	// Eye buffer pixels per radian at the center of the lens, where the density is the highest
+	float fLeft, fRight, fTop, fBottom;
+	m_pHMD->GetProjectionRaw( vr::Eye_Left, &fLeft, &fRight, &fTop, &fBottom );
+	if ( fRight - fLeft <= 0.0f )
+		return;
+	const double pixels_per_radian = (double)m_nRenderWidth / (double)(fRight - fLeft);
+
+	const int eye_images_across = (view_mode == ViewMode::LEFT_RIGHT || view_mode == ViewMode::RIGHT_LEFT) ? 2 : 1;
+	const double width_ratio = ((double)nVideoWidth / (double)eye_images_across) / (double)nVideoHeight;
+	const double min_distance = 0.1;
+
+	// Horizontal angle covered by one eye's image, matching the geometry built in AddCubeToScene
+	double angle = glm::pi<double>();
+	switch ( projection_mode )
+	{
+		case ProjectionMode::SPHERE:
+			angle = 3.14;
+			break;
+		case ProjectionMode::SPHERE360:
+			// Three cube faces of 90 degrees each across the texture
+			angle = 3.0 * glm::half_pi<double>();
+			break;
+		case ProjectionMode::EQUIRECT180:
+			angle = glm::pi<double>();
+			break;
+		case ProjectionMode::EQUIRECT360:
+			angle = glm::two_pi<double>();
+			break;
+		case ProjectionMode::FLAT:
+		{
+			const double half_width = 0.5 * (stretch ? 1.0 : 0.5) * width_ratio * eye_images_across;
+			angle = 2.0 * atan(half_width / std::max(min_distance, zoom));
+			break;
+		}
+		case ProjectionMode::CYLINDER:
+		{
+			const double angle_half = 0.8;
+			const double radius = 1.5 * width_ratio * eye_images_across / sin(angle_half);
+			const double edge_distance = zoom + cos(angle_half) * radius * 0.6;
+			angle = 2.0 * atan(sin(angle_half) * radius / std::max(min_distance, edge_distance));
+			break;
+		}
+	}
+
+	const double useful_width = pixels_per_radian * angle * eye_images_across;
+	if ( useful_width >= (double)nVideoWidth )
+		return;
+
+	const double scale = useful_width / (double)nVideoWidth;
+	nRenderWidth = std::max((int64_t)16, (int64_t)(nVideoWidth * scale) & ~(int64_t)1);
+	nRenderHeight = std::max((int64_t)16, (int64_t)(nVideoHeight * scale) & ~(int64_t)1);
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Asks the mpv thread for video buffers of the size given by
+//          GetVideoRenderSize. Unless bForce is set, small changes are ignored
+//          to avoid reallocating the buffers on every zoom step.
+//-----------------------------------------------------------------------------
+void CMainApplication::UpdateVideoRenderSize( bool bForce )
+{
+	int64_t render_width = 0;
+	int64_t render_height = 0;
+	GetVideoRenderSize( mpv_video_width, mpv_video_height, render_width, render_height );
+
+	if ( render_width == mpv_render_width && render_height == mpv_render_height )
+		return;
+
+	if ( !bForce && mpv_render_width > 0 && std::abs( render_width - mpv_render_width ) < mpv_render_width / 8 )
+		return;
+
+	mpv_render_width = render_width;
+	mpv_render_height = render_height;
+	dprintf( "Video %ldx%ld is rendered at %ldx%ld\n", mpv_video_width, mpv_video_height, mpv_render_width, mpv_render_height );
+	request_video_resize( mpv_render_width, mpv_render_height );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+bool CMainApplication::SetupStereoRenderTargets()
+{
+	if ( !m_pHMD )
+		return false;
+
+	m_pHMD->GetRecommendedRenderTargetSize( &m_nRenderWidth, &m_nRenderHeight );
+
+	// Overlays show the source directly, the eye targets aren't used
+	if ( overlay_mode )
+		dynamic_resolution_enabled = false;
+
+	// With dynamic resolution the targets are allocated once at the largest scale and only the viewport changes
+	const float fMaxScale = dynamic_resolution_enabled ? DYNAMIC_RESOLUTION_MAX_SCALE : 1.0f;
+	m_nEyeTargetWidth = (uint32_t)( m_nRenderWidth * fMaxScale );
+	m_nEyeTargetHeight = (uint32_t)( m_nRenderHeight * fMaxScale );
+
+	CreateFrameBuffer( m_nEyeTargetWidth, m_nEyeTargetHeight, m_nHiddenAreaCount[0] > 0, leftEyeDesc );
+	CreateFrameBuffer( m_nEyeTargetWidth, m_nEyeTargetHeight, m_nHiddenAreaCount[1] > 0, rightEyeDesc );
+	PrintEyeTargetMemory();
+
+	if ( dynamic_resolution_enabled )
+		dynamic_resolution.init( DYNAMIC_RESOLUTION_MIN_SCALE, DYNAMIC_RESOLUTION_MAX_SCALE );
+	SetEyeViewportSize( dynamic_resolution_enabled ? dynamic_resolution.get_scale() : 1.0f );
+	
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Sets the part of the eye targets that is rendered to. It's
+//          centered in the targets, so that the texture bounds submitted to
+//          the compositor are the same whichever way up it reads the
+//          opengl textures
+//-----------------------------------------------------------------------------
+void CMainApplication::SetEyeViewportSize( float fScale )
+{
+	const uint32_t nWidth = std::min( m_nEyeTargetWidth, (uint32_t)( m_nRenderWidth * fScale ) );
+	const uint32_t nHeight = std::min( m_nEyeTargetHeight, (uint32_t)( m_nRenderHeight * fScale ) );
+	// Same size of the border on both sides
+	m_nEyeViewportWidth = m_nEyeTargetWidth - ( ( m_nEyeTargetWidth - nWidth ) & ~1u );
+	m_nEyeViewportHeight = m_nEyeTargetHeight - ( ( m_nEyeTargetHeight - nHeight ) & ~1u );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns true if the frame can be rendered once for both eyes. That
+//          is the case when the content is the same for both eyes and so far
+//          away that the distance between the eyes doesn't matter, like mono
+//          panoramas, or with --mono-render for any mono content. Creates the
+//          mono target the first time and sizes its viewport
+//-----------------------------------------------------------------------------
+bool CMainApplication::UseMonoTarget()
+{
+	if ( !m_bMonoPossible || ( view_mode != ViewMode::PLANE && view_mode != ViewMode::SPHERE360 ) )
+		return false;
+
+	const bool bPanorama = projection_mode != ProjectionMode::FLAT && projection_mode != ProjectionMode::CYLINDER;
+	if ( !bPanorama && !mono_render )
+		return false;
+
+	if ( monoEyeDesc.m_nRenderFramebufferId == 0 )
+	{
+		const bool bCreated = CreateFrameBuffer( m_nMonoTargetWidth, m_nMonoTargetHeight, false, monoEyeDesc );
+		// Creating it binds the new objects
+		gl_state.invalidate();
+		if ( !bCreated )
+		{
+			fprintf( stderr, "Failed to create the %ux%u mono target, rendering both eyes\n", m_nMonoTargetWidth, m_nMonoTargetHeight );
+			m_bMonoPossible = false;
+			return false;
+		}
+		dprintf( "Rendering mono content once for both eyes at %ux%u\n", m_nMonoTargetWidth, m_nMonoTargetHeight );
+	}
+
+	// Scaled like the eye targets, see SetEyeViewportSize
+	const float fScale = dynamic_resolution_enabled ? dynamic_resolution.get_scale() / DYNAMIC_RESOLUTION_MAX_SCALE : 1.0f;
+	const uint32_t nWidth = std::min( m_nMonoTargetWidth, (uint32_t)( m_nMonoTargetWidth * fScale ) );
+	const uint32_t nHeight = std::min( m_nMonoTargetHeight, (uint32_t)( m_nMonoTargetHeight * fScale ) );
+	m_nMonoViewportWidth = m_nMonoTargetWidth - ( ( m_nMonoTargetWidth - nWidth ) & ~1u );
+	m_nMonoViewportHeight = m_nMonoTargetHeight - ( ( m_nMonoTargetHeight - nHeight ) & ~1u );
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Prints how much gpu memory each eye's targets take. Drivers may
+//          pad or compress them, these are the sizes of the pixel formats
+//-----------------------------------------------------------------------------
+void CMainApplication::PrintEyeTargetMemory()
+{
+	const double fMiB = 1.0 / ( 1024.0 * 1024.0 );
+	const double fPixels = (double)m_nEyeTargetWidth * (double)m_nEyeTargetHeight;
+	// 4 samples per pixel, depth is stored in 32 bits by most drivers
+	const double fColor = fPixels * 4.0 * 4.0 * fMiB;
+	const double fResolve = fPixels * 4.0 * fMiB;
+	const double fDepth = fPixels * 4.0 * 4.0 * fMiB;
+	const double fStencil = leftEyeDesc.m_nDepthBufferId != 0 ? fPixels * 4.0 * fMiB : 0.0;
+
+	if ( lean_targets )
+	{
+		// Besides the memory, every frame the depth buffer was cleared, and tested and written for every sample of the scene
+		fprintf( stderr, "Eye targets: %.1f MiB per eye (multisampled color %.1f, stencil %.1f, resolve %.1f), %.1f MiB less than with a depth buffer\n",
+			fColor + fStencil + fResolve, fColor, fStencil, fResolve, fDepth - fStencil );
+	}
+	else
+	{
+		fprintf( stderr, "Eye targets: %.1f MiB per eye (multisampled color %.1f, depth %.1f, resolve %.1f)\n",
+			fColor + fDepth + fResolve, fColor, fDepth, fResolve );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Tells the driver that the multisampled attachments of an eye
+//          don't have to be kept after they have been resolved, so tiled and
+//          compressing gpus can skip storing them
+//-----------------------------------------------------------------------------
+void CMainApplication::InvalidateEyeTarget( const FramebufferDesc &framebufferDesc )
+{
+	if ( !GLEW_ARB_invalidate_subdata )
+		return;
+
+	GLenum attachments[2] = { GL_COLOR_ATTACHMENT0 };
+	GLsizei nAttachments = 1;
+	if ( framebufferDesc.m_nDepthBufferId != 0 )
+		attachments[nAttachments++] = lean_targets ? GL_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT;
+
+	gl_state.bind_framebuffer( GL_READ_FRAMEBUFFER, framebufferDesc.m_nRenderFramebufferId );
+	glInvalidateFramebuffer( GL_READ_FRAMEBUFFER, nAttachments, attachments );
 }
 
 
 //-----------------------------------------------------------------------------
-// Purpose:
+// Purpose: Changes the render scale based on how long the gpu took for the
+//          previous frames
 //-----------------------------------------------------------------------------
-bool CMainApplication::SetupStereoRenderTargets()
+void CMainApplication::UpdateDynamicResolution()
 {
-	if ( !m_pHMD )
-		return false;
-
-	m_pHMD->GetRecommendedRenderTargetSize( &m_nRenderWidth, &m_nRenderHeight );
+	double fCompositorGpuMs = 0.0;
+	bool bFrameMissed = false;
+	vr::Compositor_FrameTiming timing;
+	timing.m_nSize = sizeof( timing );
+	if ( vr::VRCompositor()->GetFrameTiming( &timing, 0 ) && timing.m_nFrameIndex != last_frame_timing_index )
+	{
+		last_frame_timing_index = timing.m_nFrameIndex;
+		fCompositorGpuMs = timing.m_flTotalRenderGpuMs;
+		// A frame that is presented more than once wasn't replaced in time, the compositor reprojected it
+		bFrameMissed = timing.m_nNumFramePresents > 1 || timing.m_nNumDroppedFrames > 0;
+	}
 
-	CreateFrameBuffer( m_nRenderWidth, m_nRenderHeight, leftEyeDesc );
-	CreateFrameBuffer( m_nRenderWidth, m_nRenderHeight, rightEyeDesc );
-	
-	return true;
+	const double fFrameBudgetMs = m_fDisplayFrequency > 0.0f ? 1000.0 / m_fDisplayFrequency : 0.0;
+	if ( dynamic_resolution.update( fFrameBudgetMs, fCompositorGpuMs, bFrameMissed ) )
+		SetEyeViewportSize( dynamic_resolution.get_scale() );
 }
 
 
@@ -2714,143 +4313,313 @@ void CMainApplication::RenderStereoTargets()
 {
 
 	glClearColor( 0.0f, 0.0f, 0.0f, 1.0f );
-	glEnable( GL_MULTISAMPLE );
+	// Resolving with glBlitFramebuffer doesn't depend on GL_MULTISAMPLE, so it stays enabled
+	gl_state.set_enabled( GL_MULTISAMPLE, true );
 
-	// Left Eye
-	glBindFramebuffer( GL_FRAMEBUFFER, leftEyeDesc.m_nRenderFramebufferId );
- 	glViewport(0, 0, m_nRenderWidth, m_nRenderHeight );
- 	RenderScene( vr::Eye_Left );
- 	glBindFramebuffer( GL_FRAMEBUFFER, 0 );
-	
-	glDisable( GL_MULTISAMPLE );
-	 	
- 	glBindFramebuffer(GL_READ_FRAMEBUFFER, leftEyeDesc.m_nRenderFramebufferId);
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, leftEyeDesc.m_nResolveFramebufferId );
+	UpdateSceneUniforms();
 
-    glBlitFramebuffer( 0, 0, m_nRenderWidth, m_nRenderHeight, 0, 0, m_nRenderWidth, m_nRenderHeight, 
-		GL_COLOR_BUFFER_BIT,
- 		GL_LINEAR );
+	if ( m_bMonoFrame )
+	{
+		RenderEyeTarget( vr::Eye_Left, monoEyeDesc, m_nMonoTargetWidth, m_nMonoTargetHeight, m_nMonoViewportWidth, m_nMonoViewportHeight );
+		return;
+	}
 
- 	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0 );	
-	
-	glEnable( GL_MULTISAMPLE );
-
-	// Right Eye
-	glBindFramebuffer( GL_FRAMEBUFFER, rightEyeDesc.m_nRenderFramebufferId );
- 	glViewport(0, 0, m_nRenderWidth, m_nRenderHeight );
- 	RenderScene( vr::Eye_Right );
- 	glBindFramebuffer( GL_FRAMEBUFFER, 0 );
- 	
-	glDisable( GL_MULTISAMPLE );
-
- 	glBindFramebuffer(GL_READ_FRAMEBUFFER, rightEyeDesc.m_nRenderFramebufferId );
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, rightEyeDesc.m_nResolveFramebufferId );
-	
-    glBlitFramebuffer( 0, 0, m_nRenderWidth, m_nRenderHeight, 0, 0, m_nRenderWidth, m_nRenderHeight, 
-		GL_COLOR_BUFFER_BIT,
- 		GL_LINEAR  );
+	RenderEyeTarget( vr::Eye_Left, leftEyeDesc, m_nEyeTargetWidth, m_nEyeTargetHeight, m_nEyeViewportWidth, m_nEyeViewportHeight );
+	RenderEyeTarget( vr::Eye_Right, rightEyeDesc, m_nEyeTargetWidth, m_nEyeTargetHeight, m_nEyeViewportWidth, m_nEyeViewportHeight );
+}
 
- 	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0 );
 
-	//glEnable( GL_MULTISAMPLE );
+//-----------------------------------------------------------------------------
+// Purpose: Renders an eye to the centered part of its target, see
+//          SetEyeViewportSize, and resolves it
+//-----------------------------------------------------------------------------
+void CMainApplication::RenderEyeTarget( vr::Hmd_Eye nEye, const FramebufferDesc &framebufferDesc, uint32_t nTargetWidth, uint32_t nTargetHeight, uint32_t nViewportWidth, uint32_t nViewportHeight )
+{
+	const GLint nViewportX = ( nTargetWidth - nViewportWidth ) / 2;
+	const GLint nViewportY = ( nTargetHeight - nViewportHeight ) / 2;
+	const GLint nViewportX2 = nViewportX + nViewportWidth;
+	const GLint nViewportY2 = nViewportY + nViewportHeight;
+
+	gl_state.bind_framebuffer( GL_FRAMEBUFFER, framebufferDesc.m_nRenderFramebufferId );
+	gl_state.viewport( nViewportX, nViewportY, nViewportWidth, nViewportHeight );
+ 	RenderScene( nEye );
 
-	//glBindTexture(GL_TEXTURE_2D, 0);
+	gl_state.bind_framebuffer( GL_DRAW_FRAMEBUFFER, framebufferDesc.m_nResolveFramebufferId );
+    glBlitFramebuffer( nViewportX, nViewportY, nViewportX2, nViewportY2, nViewportX, nViewportY, nViewportX2, nViewportY2, 
+		GL_COLOR_BUFFER_BIT,
+ 		GL_LINEAR );
+	InvalidateEyeTarget( framebufferDesc );
 }
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Renders a scene with respect to nEye.
+// Purpose: Uploads the uniforms of both eyes for this frame. The texture
+//          offset of each eye follows from the view mode the scene shader
+//          was built for, so only the matrices and the cursor change.
 //-----------------------------------------------------------------------------
-void CMainApplication::RenderScene( vr::Hmd_Eye nEye )
+void CMainApplication::UpdateSceneUniforms()
 {
-	if(!src_window_id && !mpv_file)
-		return;
-	
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glEnable(GL_DEPTH_TEST);
+	SceneEyeUniforms eyeUniforms[2] = {};
+	if ( m_bMonoFrame )
+	{
+		// Rendered with the first eye's uniforms
+		eyeUniforms[0].matrix = m_mat4ProjectionMono * GetCurrentViewMatrix();
+		eyeUniforms[1].matrix = eyeUniforms[0].matrix;
+	}
+	else
+	{
+		eyeUniforms[0].matrix = GetCurrentViewProjectionMatrix( vr::Eye_Left );
+		eyeUniforms[1].matrix = GetCurrentViewProjectionMatrix( vr::Eye_Right );
+	}
+	eyeUniforms[0].eye = 0;
+	eyeUniforms[1].eye = 1;
+	if ( is_equirect( projection_mode ) )
+	{
+		eyeUniforms[0].inverse_matrix = glm::inverse( eyeUniforms[0].matrix );
+		eyeUniforms[1].inverse_matrix = glm::inverse( eyeUniforms[1].matrix );
+	}
+	else
+	{
+		CullScenePatches( 0, eyeUniforms[0].matrix );
+		if ( !m_bMonoFrame )
+			CullScenePatches( 1, eyeUniforms[1].matrix );
+	}
 
-	glUseProgram( m_unSceneProgramID );
-	glUniformMatrix4fv( m_nSceneMatrixLocation, 1, GL_FALSE, glm::value_ptr(GetCurrentViewProjectionMatrix( nEye )));
+	glBindBuffer( GL_UNIFORM_BUFFER, m_glSceneEyeUniformBuffer );
+	// Orphan the previous frame's data instead of waiting for the gpu to finish reading it
+	glBufferData( GL_UNIFORM_BUFFER, 2 * m_nSceneEyeUniformsStride, nullptr, GL_STREAM_DRAW );
+	glBufferSubData( GL_UNIFORM_BUFFER, 0, sizeof(SceneEyeUniforms), &eyeUniforms[0] );
+	glBufferSubData( GL_UNIFORM_BUFFER, m_nSceneEyeUniformsStride, sizeof(SceneEyeUniforms), &eyeUniforms[1] );
+	glBindBuffer( GL_UNIFORM_BUFFER, 0 );
 
+	if(mpv_file)
+		return;
+
+	// The cursor location is relative to the first eye's half of the window, the shader offsets it for the other eye
 	float m[2];
 	m[0] = mouse_x / (float)window_width;
 	m[1] = mouse_y / (float)window_height;
 
-	if(view_mode != ViewMode::PLANE) {
+	if(view_mode == ViewMode::TOP_BOTTOM) {
+		if(cursor_wrap && m[1] >= 0.5f)
+			m[1] -= 0.5f;
+		else if(!cursor_wrap)
+			m[1] *= 0.5f;
+	} else if(view_mode != ViewMode::PLANE) {
 		if(cursor_wrap && m[0] >= 0.5f)
 			m[0] -= 0.5f;
 		else if(!cursor_wrap)
 			m[0] *= 0.5f;
 	}
 
-	if( nEye == vr::Eye_Left )
+	float drawn_arrow_width = cursor_scale_uniform[0] * window_width;
+	float drawn_arrow_height = cursor_scale_uniform[1] * window_height;
+	float arrow_drawn_scale_x = drawn_arrow_width / (float)(arrow_image_width == 0 ? 1 : arrow_image_width);
+	float arrow_drawn_scale_y = drawn_arrow_height / (float)(arrow_image_height == 0 ? 1 : arrow_image_height);
+
+	m[0] += (-cursor_offset_x * arrow_drawn_scale_x) / (float)window_width;
+	m[1] += (-cursor_offset_y * arrow_drawn_scale_y) / (float)window_height;
+
+	gl_state.use_program( m_unSceneProgramID );
+	glUniform2fv(m_nCursorLocation, 1, &m[0]);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Collects the vertex ranges of the scene patches that can be seen
+//          with |matrix|. Most of the sphere and the cube of sphere360 are
+//          outside of the headset's field of view
+//-----------------------------------------------------------------------------
+void CMainApplication::CullScenePatches( int nEyeIndex, const glm::mat4 &matrix )
+{
+	std::vector<GLint> &firsts = m_sceneDrawFirsts[nEyeIndex];
+	std::vector<GLsizei> &counts = m_sceneDrawCounts[nEyeIndex];
+	firsts.clear();
+	counts.clear();
+
+	for ( const ScenePatch &patch : m_scenePatches )
 	{
-		float offset = 0.0f;
-		float scale = 0.5f;
-		if(view_mode == ViewMode::RIGHT_LEFT) {
-			offset = 0.5f;
-		} else if(view_mode == ViewMode::PLANE || view_mode == ViewMode::SPHERE360) {
-			offset = 0.0f;
-			scale = 1.0f;
+		if ( scene_patch_outside_frustum( matrix, patch ) )
+			continue;
+
+		if ( !firsts.empty() && firsts.back() + counts.back() == patch.first )
+		{
+			counts.back() += patch.count;
+		}
+		else
+		{
+			firsts.push_back( patch.first );
+			counts.push_back( patch.count );
 		}
-		glUniform1fv(m_nSceneTextureOffsetXLocation, 1, &offset);
-		glUniform1fv(m_nSceneTextureScaleXLocation, 1, &scale);
+	}
+}
+
 
-		if(view_mode == ViewMode::RIGHT_LEFT)
-			m[0] += offset;
+// Appends a mesh that covers the unit square outside of the ellipse that touches its edges, as a stand-in for
+// the hidden area mesh of a headset. The rays to the corners are part of the segments, so every quad between
+// the ellipse and the edge of the square is convex
+static void create_synthetic_hidden_area_mesh( std::vector<glm::vec2> &vertices )
+{
+	const int segments = 32;
+	const glm::vec2 center( 0.5f, 0.5f );
+	for( int i = 0; i < segments; ++i )
+	{
+		const float angle1 = glm::two_pi<float>() * (float)i / (float)segments;
+		const float angle2 = glm::two_pi<float>() * (float)( i + 1 ) / (float)segments;
+		const glm::vec2 dir1( cos( angle1 ), sin( angle1 ) );
+		const glm::vec2 dir2( cos( angle2 ), sin( angle2 ) );
+		const glm::vec2 inner1 = center + dir1 * 0.5f;
+		const glm::vec2 inner2 = center + dir2 * 0.5f;
+		const glm::vec2 outer1 = center + dir1 * ( 0.5f / std::max( fabsf( dir1.x ), fabsf( dir1.y ) ) );
+		const glm::vec2 outer2 = center + dir2 * ( 0.5f / std::max( fabsf( dir2.x ), fabsf( dir2.y ) ) );
+
+		vertices.push_back( inner1 );
+		vertices.push_back( outer1 );
+		vertices.push_back( outer2 );
+
+		vertices.push_back( inner1 );
+		vertices.push_back( outer2 );
+		vertices.push_back( inner2 );
 	}
-	else if( nEye == vr::Eye_Right )
+}
+
+// Area of the triangles in |vertices|, the triangles of a hidden area mesh don't overlap
+static float triangles_area( const glm::vec2 *vertices, size_t num_vertices )
+{
+	float area = 0.0f;
+	for( size_t i = 0; i + 2 < num_vertices; i += 3 )
+	{
+		const glm::vec2 a = vertices[i + 1] - vertices[i];
+		const glm::vec2 b = vertices[i + 2] - vertices[i];
+		area += 0.5f * fabsf( a.x * b.y - a.y * b.x );
+	}
+	return area;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Gets the hidden area mesh of each eye, the part of the render
+//          target that is hidden by the lenses
+//-----------------------------------------------------------------------------
+void CMainApplication::SetupHiddenAreaMesh()
+{
+	std::vector<glm::vec2> vVerts;
+	for ( int nEyeIndex = 0; nEyeIndex < 2; ++nEyeIndex )
 	{
-		float offset = 0.5f;
-		float scale = 0.5f;
-		if (view_mode == ViewMode::RIGHT_LEFT) {
-			offset = 0.0f;
-		} else if (view_mode == ViewMode::PLANE || view_mode == ViewMode::SPHERE360) {
-			offset = 0.0f;
-			scale = 1.0f;
+		const size_t nFirst = vVerts.size();
+		if ( synthetic_hidden_area )
+		{
+			create_synthetic_hidden_area_mesh( vVerts );
+		}
+		else
+		{
+			const vr::HiddenAreaMesh_t mesh = m_pHMD->GetHiddenAreaMesh( nEyeIndex == 0 ? vr::Eye_Left : vr::Eye_Right, vr::k_eHiddenAreaMesh_Standard );
+			for ( uint32_t i = 0; i < mesh.unTriangleCount * 3; ++i )
+			{
+				vVerts.push_back( glm::vec2( mesh.pVertexData[i].v[0], mesh.pVertexData[i].v[1] ) );
+			}
 		}
-		glUniform1fv(m_nSceneTextureOffsetXLocation, 1, &offset);
-		glUniform1fv(m_nSceneTextureScaleXLocation, 1, &scale);
 
-		if(view_mode == ViewMode::LEFT_RIGHT)
-			m[0] += offset;
+		m_nHiddenAreaFirst[nEyeIndex] = nFirst;
+		m_nHiddenAreaCount[nEyeIndex] = vVerts.size() - nFirst;
+		m_fHiddenAreaFraction[nEyeIndex] = std::min( 1.0f, triangles_area( vVerts.data() + nFirst, vVerts.size() - nFirst ) );
 	}
 
+	fprintf( stderr, "Hidden area: %.1f%% of the left eye's pixels and %.1f%% of the right eye's pixels are skipped%s\n",
+		m_fHiddenAreaFraction[0] * 100.0f, m_fHiddenAreaFraction[1] * 100.0f, synthetic_hidden_area ? " (synthetic mesh)" : "" );
+	if ( vVerts.empty() )
+		return;
 
-	float drawn_arrow_width = cursor_scale_uniform[0] * window_width;
-	float drawn_arrow_height = cursor_scale_uniform[1] * window_height;
-	float arrow_drawn_scale_x = drawn_arrow_width / (float)(arrow_image_width == 0 ? 1 : arrow_image_width);
-	float arrow_drawn_scale_y = drawn_arrow_height / (float)(arrow_image_height == 0 ? 1 : arrow_image_height);
+	glGenVertexArrays( 1, &m_unHiddenAreaVAO );
+	glBindVertexArray( m_unHiddenAreaVAO );
 
-	m[0] += (-cursor_offset_x * arrow_drawn_scale_x) / (float)window_width;
-	m[1] += (-cursor_offset_y * arrow_drawn_scale_y) / (float)window_height;
+	glGenBuffers( 1, &m_glHiddenAreaVertBuffer );
+	glBindBuffer( GL_ARRAY_BUFFER, m_glHiddenAreaVertBuffer );
+	glBufferData( GL_ARRAY_BUFFER, vVerts.size() * sizeof(glm::vec2), &vVerts[0], GL_STATIC_DRAW );
 
-	glBindVertexArray( m_unSceneVAO );
-	glActiveTexture(GL_TEXTURE0);
+	glEnableVertexAttribArray( 0 );
+	glVertexAttribPointer( 0, 2, GL_FLOAT, GL_FALSE, sizeof(glm::vec2), (void *)0 );
+
+	glBindVertexArray( 0 );
+	glDisableVertexAttribArray( 0 );
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Renders a scene with respect to nEye.
+//-----------------------------------------------------------------------------
+void CMainApplication::RenderScene( vr::Hmd_Eye nEye )
+{
+	if(!src_window_id && !mpv_file)
+		return;
+	
+	const int nEyeIndex = nEye == vr::Eye_Left ? 0 : 1;
+	// The mono image is seen by both eyes, the part one eye can't see may be seen by the other
+	const bool bHiddenArea = m_nHiddenAreaCount[nEyeIndex] > 0 && !m_bMonoFrame;
+	if ( lean_targets )
+	{
+		// Nothing in the scene overlaps, the stencil buffer is only there for the hidden area
+		glClear( bHiddenArea ? GL_COLOR_BUFFER_BIT | GL_STENCIL_BUFFER_BIT : GL_COLOR_BUFFER_BIT );
+		gl_state.set_enabled( GL_DEPTH_TEST, false );
+		gl_state.set_enabled( GL_STENCIL_TEST, bHiddenArea );
+	}
+	else
+	{
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		gl_state.set_enabled( GL_DEPTH_TEST, true );
+	}
+
+	if ( bHiddenArea )
+	{
+		// The hidden pixels get the nearest depth, or a stencil value with --lean-targets, so the scene fails the depth or
+		// stencil test there before its fragment shader runs
+		glColorMask( GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE );
+		if ( lean_targets )
+		{
+			glStencilFunc( GL_ALWAYS, 1, 0xFF );
+			glStencilOp( GL_KEEP, GL_KEEP, GL_REPLACE );
+		}
+		gl_state.use_program( m_unHiddenAreaProgramID );
+		gl_state.bind_vertex_array( m_unHiddenAreaVAO );
+		glDrawArrays( GL_TRIANGLES, m_nHiddenAreaFirst[nEyeIndex], m_nHiddenAreaCount[nEyeIndex] );
+		glColorMask( GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE );
+		if ( lean_targets )
+		{
+			glStencilFunc( GL_EQUAL, 0, 0xFF );
+			glStencilOp( GL_KEEP, GL_KEEP, GL_KEEP );
+		}
+	}
+
+	gl_state.use_program( m_unSceneProgramID );
+	const GLintptr nEyeUniformsOffset = nEyeIndex * m_nSceneEyeUniformsStride;
+	glBindBufferRange( GL_UNIFORM_BUFFER, 0, m_glSceneEyeUniformBuffer, nEyeUniformsOffset, sizeof(SceneEyeUniforms) );
+
+	gl_state.bind_vertex_array( m_unSceneVAO );
 	if(mpv_file)
 	{
 		if(mpvBuffers != nullptr)
 		{
-			m[0] = -1.0f;
-			m[1] = -1.0f;
-			glBindTexture(GL_TEXTURE_2D, mpvBuffers->get_showTextureId());
+			gl_state.bind_texture( 0, GL_TEXTURE_2D, mpvBuffers->get_showTextureId() );
 		}
 	}
 	else
 	{
-		glBindTexture(GL_TEXTURE_2D, window_texture_get_opengl_texture_id(&window_texture));
+		gl_state.bind_texture( 0, GL_TEXTURE_2D, window_texture_get_opengl_texture_id(&window_texture) );
+	}
+	gl_state.bind_texture( 1, GL_TEXTURE_2D, mpv_file ? 0 : arrow_image_texture_id );
+	gl_state.bind_sampler( 0, m_unMipmapSampler );
+	gl_state.bind_sampler( 1, m_unMipmapSampler );
+	if ( is_equirect( projection_mode ) )
+	{
+		// One triangle that covers the whole view, its vertices are generated in the vertex shader.
+		// It's at depth 0.5, so without --lean-targets it's only drawn outside of the hidden area
+		glDrawArrays( GL_TRIANGLES, 0, 3 );
+	}
+	else
+	{
+		if ( !m_sceneDrawFirsts[nEyeIndex].empty() )
+			glMultiDrawArrays( GL_TRIANGLES, m_sceneDrawFirsts[nEyeIndex].data(), m_sceneDrawCounts[nEyeIndex].data(), m_sceneDrawFirsts[nEyeIndex].size() );
 	}
-	glUniform2fv(m_nCursorLocation, 1, &m[0]);
-	//glBindTexture(GL_TEXTURE_2D, mpv_file ? mpvDesc.m_nRenderTextureId :  window_texture_get_opengl_texture_id(&window_texture));
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, mpv_file ? 0 : arrow_image_texture_id);
-	glDrawArrays( GL_TRIANGLES, 0, m_uiVertcount );
-
-	glBindVertexArray( 0 );
-	glActiveTexture(GL_TEXTURE0);
-	glUseProgram( 0 );
 }
 
 
@@ -2859,83 +4628,186 @@ void CMainApplication::RenderScene( vr::Hmd_Eye nEye )
 //-----------------------------------------------------------------------------
 void CMainApplication::RenderCompanionWindow()
 {
-	glDisable(GL_DEPTH_TEST);
-	glViewport( 0, 0, m_nCompanionWindowWidth, m_nCompanionWindowHeight );
-
-	glBindVertexArray( m_unCompanionWindowVAO );
-	glUseProgram( m_unCompanionWindowProgramID );
+	gl_state.bind_framebuffer( GL_FRAMEBUFFER, 0 );
+	gl_state.set_enabled( GL_DEPTH_TEST, false );
+	gl_state.set_enabled( GL_STENCIL_TEST, false );
+	gl_state.viewport( 0, 0, m_nCompanionWindowWidth, m_nCompanionWindowHeight );
+
+	gl_state.bind_vertex_array( m_unCompanionWindowVAO );
+	gl_state.use_program( m_unCompanionWindowProgramID );
+	if ( m_bMonoFrame )
+		glUniform2f( m_nCompanionUVScaleLocation, (float)m_nMonoViewportWidth / (float)m_nMonoTargetWidth, (float)m_nMonoViewportHeight / (float)m_nMonoTargetHeight );
+	else
+		glUniform2f( m_nCompanionUVScaleLocation, (float)m_nEyeViewportWidth / (float)m_nEyeTargetWidth, (float)m_nEyeViewportHeight / (float)m_nEyeTargetHeight );
+	gl_state.bind_sampler( 0, m_unLinearSampler );
 
 	// render left eye (first half of index array )
-	glBindTexture(GL_TEXTURE_2D, leftEyeDesc.m_nResolveTextureId );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+	gl_state.bind_texture( 0, GL_TEXTURE_2D, ( m_bMonoFrame ? monoEyeDesc : leftEyeDesc ).m_nResolveTextureId );
 	glDrawElements( GL_TRIANGLES, m_uiCompanionWindowIndexSize/2, GL_UNSIGNED_SHORT, 0 );
 
 	// render right eye (second half of index array )
-	glBindTexture(GL_TEXTURE_2D, rightEyeDesc.m_nResolveTextureId  );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+	gl_state.bind_texture( 0, GL_TEXTURE_2D, ( m_bMonoFrame ? monoEyeDesc : rightEyeDesc ).m_nResolveTextureId );
 	glDrawElements( GL_TRIANGLES, m_uiCompanionWindowIndexSize/2, GL_UNSIGNED_SHORT, (const void *)(uintptr_t)(m_uiCompanionWindowIndexSize) );
-
-	glBindVertexArray( 0 );
-	glUseProgram( 0 );
 }
 
 //-----------------------------------------------------------------------------
 // Purpose: Present the window/video texture as an overlay
 //-----------------------------------------------------------------------------
-void CMainApplication::RenderOverlay() {
+void CMainApplication::RenderOverlay( vr::VROverlayHandle_t ulOverlayHandle ) {
 	GLuint texture_id = 0;
+	// Flip OpenGL texture upside down
+	vr::VRTextureBounds_t bounds = {0, 1, 1, 0};
 
 	if(mpv_file) {
 		if(!mpvBuffers)
 			return;
 		texture_id = mpvBuffers->get_showTextureId();
 	}
-	else if (overlay_buffers) {
-		// OpenVR relies on a shared OpenGL context
-		// which does not play well with the GLX
-		// extension used to copy data from the
-		// application, so data should be copied to a
-		// separate texture.
+	else if (src_window_id) {
+		// The window is already copied out of the GLX pixmap into an ordinary texture by window_texture_update,
+		// which the compositor can read through the shared context. Its rows are in X order, top first
+		texture_id = window_texture_get_opengl_texture_id(&window_texture);
+		bounds = {0, 0, 1, 1};
+	}
+	else
+		return;
+
+	vr::Texture_t overlay_tex = {(void*)(uintptr_t)texture_id,
+		vr::TextureType_OpenGL, vr::ColorSpace_Gamma};
+
+	vr::VROverlay()->SetOverlayTexture(ulOverlayHandle, &overlay_tex);
+	vr::VROverlay()->SetOverlayTextureBounds(ulOverlayHandle, &bounds);
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns true if the screen is shown with the --native-layer
+//          overlay. Overlays can only be flat or curved like a cylinder and
+//          only know side by side stereo
+//-----------------------------------------------------------------------------
+bool CMainApplication::UseNativeLayer()
+{
+	if ( native_layer_handle == vr::k_ulOverlayHandleInvalid )
+		return false;
+
+	return ( projection_mode == ProjectionMode::FLAT || projection_mode == ProjectionMode::CYLINDER ) && view_mode != ViewMode::TOP_BOTTOM;
+}
 
-		overlay_buffers->swap_buffer();
 
-		GLuint ref_texture = window_texture_get_opengl_texture_id(&window_texture);
-		texture_id = overlay_buffers->get_showTextureId();
+//-----------------------------------------------------------------------------
+// Purpose: Shows or hides the --native-layer overlay and places it where the
+//          flat or plane mesh would be, see AddCubeToScene. The compositor
+//          samples the window or video texture once, straight into the
+//          distorted output, instead of it being resampled into the eye
+//          images first
+//-----------------------------------------------------------------------------
+void CMainApplication::UpdateNativeLayer()
+{
+	if ( native_layer_handle == vr::k_ulOverlayHandleInvalid )
+		return;
 
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, ref_texture);
-		glBindVertexArray( m_unCompanionWindowVAO );
-		glUseProgram(m_unOverlayProgramID);
-		glUniform1i(m_unOverlayTextureLoc, 0);
+	if ( !m_bNativeLayerFrame )
+	{
+		if ( native_layer_visible )
+			vr::VROverlay()->HideOverlay( native_layer_handle );
+		native_layer_visible = false;
+		return;
+	}
 
-		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, overlay_buffers->get_renderFramebufferId());
+	if ( !native_layer_visible )
+	{
+		// The view mode can change along with the projection
+		vr::VROverlay()->SetOverlayFlag( native_layer_handle, vr::VROverlayFlags_SideBySide_Parallel, view_mode == ViewMode::LEFT_RIGHT );
+		vr::VROverlay()->SetOverlayFlag( native_layer_handle, vr::VROverlayFlags_SideBySide_Crossed, view_mode == ViewMode::RIGHT_LEFT );
+		vr::VROverlay()->ShowOverlay( native_layer_handle );
+		native_layer_visible = true;
+	}
 
-		glDisable(GL_DEPTH_TEST);
-		glDrawBuffer(GL_COLOR_ATTACHMENT0);
-		glViewport(0, 0, pixmap_texture_width, pixmap_texture_height);
+	if ( !native_layer_pos_set && pose_wait_time != 0 && m_rTrackedDevicePose[vr::k_unTrackedDeviceIndex_Hmd].bPoseIsValid )
+	{
+		native_layer_pos = current_pos;
+		native_layer_pos_set = true;
+	}
 
-		glDrawElements( GL_TRIANGLES, m_uiCompanionWindowIndexSize/2, GL_UNSIGNED_SHORT, 0 );
-		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	const double width_ratio = (double)pixmap_texture_width / (double)pixmap_texture_height;
+	double width = 0.0;
+	double height = 0.0;
+	double curvature = 0.0;
+	double depth = 0.0;
+	if ( projection_mode == ProjectionMode::CYLINDER )
+	{
+		// The compositor bends the overlay into a circular arc, this one goes through the middle and the edges of the mesh's arc
+		const double radius = PLANE_HALF_HEIGHT * width_ratio / sin( PLANE_HALF_ANGLE );
+		const double chord = 2.0 * radius * sin( PLANE_HALF_ANGLE );
+		const double sagitta = radius * PLANE_DEPTH_SCALE * ( 1.0 - cos( PLANE_HALF_ANGLE ) );
+		const double circle_radius = ( chord * chord * 0.25 + sagitta * sagitta ) / ( 2.0 * sagitta );
+		width = 2.0 * circle_radius * asin( std::min( 1.0, chord * 0.5 / circle_radius ) );
+		height = 2.0 * PLANE_HALF_HEIGHT;
+		// Part of a full circle
+		curvature = width / ( 2.0 * glm::pi<double>() * circle_radius );
+		depth = zoom + radius * PLANE_DEPTH_SCALE;
 	}
 	else
-		return;
+	{
+		height = 2.0 * FLAT_HALF_HEIGHT;
+		width = height * ( stretch ? 1.0 : 0.5 ) * width_ratio;
+		depth = zoom;
+	}
 
-	vr::Texture_t overlay_tex = {(void*)(uintptr_t)texture_id,
-		vr::TextureType_OpenGL, vr::ColorSpace_Gamma};
+	// The overlay's height comes from the aspect ratio of one eye's part of the texture and the texel aspect
+	const bool bSideBySide = view_mode == ViewMode::LEFT_RIGHT || view_mode == ViewMode::RIGHT_LEFT;
+	const double eye_width_ratio = bSideBySide ? width_ratio * 0.5 : width_ratio;
+	const float fTexelAspect = (float)( ( width / height ) / eye_width_ratio );
+
+	// Placed in the scene's space like the mesh, the scene flips z
+	const glm::vec3 pos = free_camera ? hmd_pos : native_layer_pos;
+	const glm::mat4 matTransform = glm::translate( glm::mat4( 1.0f ), pos ) * mat4_cast( m_reset_rotation ) * glm::translate( glm::mat4( 1.0f ), glm::vec3( 0.0f, 0.0f, -(float)depth ) );
+
+	if ( (float)width != native_layer_width )
+	{
+		native_layer_width = (float)width;
+		vr::VROverlay()->SetOverlayWidthInMeters( native_layer_handle, native_layer_width );
+	}
+	if ( (float)curvature != native_layer_curvature )
+	{
+		native_layer_curvature = (float)curvature;
+		vr::VROverlay()->SetOverlayCurvature( native_layer_handle, native_layer_curvature );
+	}
+	if ( fTexelAspect != native_layer_texel_aspect )
+	{
+		native_layer_texel_aspect = fTexelAspect;
+		vr::VROverlay()->SetOverlayTexelAspect( native_layer_handle, native_layer_texel_aspect );
+	}
+	if ( matTransform != native_layer_transform )
+	{
+		native_layer_transform = matTransform;
+		vr::HmdMatrix34_t matOverlay;
+		for ( int nRow = 0; nRow < 3; ++nRow )
+		{
+			for ( int nColumn = 0; nColumn < 4; ++nColumn )
+				matOverlay.m[nRow][nColumn] = matTransform[nColumn][nRow];
+		}
+		vr::VROverlay()->SetOverlayTransformAbsolute( native_layer_handle, vr::VRCompositor()->GetTrackingSpace(), &matOverlay );
+	}
+
+	RenderOverlay( native_layer_handle );
+}
 
-	// Flip OpenGL texture upside down
-	vr::VRTextureBounds_t bounds = {0, 1, 1, 0};
 
-	vr::VROverlay()->SetOverlayTexture(overlay_handle, &overlay_tex);
-	vr::VROverlay()->SetOverlayTextureBounds(overlay_handle, &bounds);
+//-----------------------------------------------------------------------------
+// Purpose: Clears the resolved eye images to black, they are submitted as the
+//          background of the --native-layer overlay without rendering
+//-----------------------------------------------------------------------------
+void CMainApplication::ClearEyeTargets()
+{
+	glClearColor( 0.0f, 0.0f, 0.0f, 1.0f );
+	gl_state.bind_framebuffer( GL_FRAMEBUFFER, leftEyeDesc.m_nResolveFramebufferId );
+	glClear( GL_COLOR_BUFFER_BIT );
+	gl_state.bind_framebuffer( GL_FRAMEBUFFER, rightEyeDesc.m_nResolveFramebufferId );
+	glClear( GL_COLOR_BUFFER_BIT );
+	m_bEyeTargetsCleared = true;
 }
 
+
 //-----------------------------------------------------------------------------
 // Purpose: Copy the title of the source X11 window as the overlay title
 //-----------------------------------------------------------------------------
@@ -3108,12 +4980,10 @@ glm::mat4 CMainApplication::GetHMDMatrixPoseEye( vr::Hmd_Eye nEye )
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Gets a Current View Projection Matrix with respect to nEye,
-//          which may be an Eye_Left or an Eye_Right.
+// Purpose: Gets the view matrix of the center of the head
 //-----------------------------------------------------------------------------
-glm::mat4 CMainApplication::GetCurrentViewProjectionMatrix( vr::Hmd_Eye nEye )
+glm::mat4 CMainApplication::GetCurrentViewMatrix()
 {
-	glm::mat4 matMVP;
 	//glm::mat4 pp;
 	//memcpy(&pp[0], m_mat4HMDPose.get(), sizeof(m_mat4HMDPose));
 	//memcpy(&m_mat4HMDPose[0], &pp[0], sizeof(pp));
@@ -3124,7 +4994,18 @@ glm::mat4 CMainApplication::GetCurrentViewProjectionMatrix( vr::Hmd_Eye nEye )
 		hmd_pose = glm::rotate(hmd_pose, (float)(sin(reduce_flicker_counter)*0.0005), glm::vec3(1.0f, 0.0f, 0.0f));
 		reduce_flicker_counter += 1.0;
 	}
-	hmd_pose = hmd_pose * mat4_cast(m_reset_rotation);
+	return hmd_pose * mat4_cast(m_reset_rotation);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Gets a Current View Projection Matrix with respect to nEye,
+//          which may be an Eye_Left or an Eye_Right.
+//-----------------------------------------------------------------------------
+glm::mat4 CMainApplication::GetCurrentViewProjectionMatrix( vr::Hmd_Eye nEye )
+{
+	glm::mat4 matMVP;
+	const glm::mat4 hmd_pose = GetCurrentViewMatrix();
 	if( nEye == vr::Eye_Left )
 	{
 		matMVP = m_mat4ProjectionLeft * m_mat4eyePosLeft * hmd_pose;
@@ -3147,6 +5028,7 @@ void CMainApplication::UpdateHMDMatrixPose()
 		return;
 
 	vr::VRCompositor()->WaitGetPoses(m_rTrackedDevicePose, vr::k_unMaxTrackedDeviceCount, NULL, 0 );
+	pose_wait_time = SDL_GetPerformanceCounter();
 
 	m_iValidPoseCount = 0;
 	m_strPoseClasses = "";
@@ -3186,6 +5068,109 @@ void CMainApplication::UpdateHMDMatrixPose()
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Samples the hmd pose again, predicted for when the frame that is
+//          about to be rendered reaches the display. Both eyes are shown at the
+//          same time and their matrices are uploaded together, so they share
+//          the pose
+//-----------------------------------------------------------------------------
+void CMainApplication::LatchHMDPose()
+{
+	if ( !m_pHMD )
+		return;
+
+	// Without WaitGetPoses there is no target frame to predict for, but the compositor still wants the timing
+	if ( pose_wait_time == 0 )
+	{
+		if ( m_bExplicitTiming )
+			vr::VRCompositor()->SubmitExplicitTimingData();
+		return;
+	}
+
+	// The compositor's target frame starts when the time remaining runs out and is lit one frame plus vsync-to-photons later
+	const float fFrameDuration = m_fDisplayFrequency > 0.0f ? 1.0f / m_fDisplayFrequency : 0.0f;
+	const float fPredictedSecondsFromNow = std::max( 0.0f, vr::VRCompositor()->GetFrameTimeRemaining() + fFrameDuration + m_fVsyncToPhotons );
+
+	vr::TrackedDevicePose_t pose;
+	m_pHMD->GetDeviceToAbsoluteTrackingPose( vr::VRCompositor()->GetTrackingSpace(), fPredictedSecondsFromNow, &pose, 1 );
+	pose_latch_time = SDL_GetPerformanceCounter();
+	if ( pose.bPoseIsValid )
+	{
+		m_latchedHMDPose = pose;
+		m_mat4HMDPose = glm::inverse( ConvertSteamVRMatrixToMatrix4( pose.mDeviceToAbsoluteTracking ) );
+		// The view translates by hmd_pos after the inverse pose, both have to come from the same pose to cancel out
+		current_pos.x = pose.mDeviceToAbsoluteTracking.m[0][3];
+		current_pos.y = pose.mDeviceToAbsoluteTracking.m[1][3];
+		current_pos.z = pose.mDeviceToAbsoluteTracking.m[2][3];
+		if ( !free_camera )
+			hmd_pos = current_pos;
+	}
+	else
+	{
+		m_latchedHMDPose.bPoseIsValid = false;
+	}
+
+	// Called right before the first gl command that uses the pose
+	if ( m_bExplicitTiming )
+		vr::VRCompositor()->SubmitExplicitTimingData();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Submits both eyes along with the pose they were rendered with, so
+//          that the compositor reprojects from that pose instead of the one
+//          from WaitGetPoses
+//-----------------------------------------------------------------------------
+void CMainApplication::SubmitEyeTextures()
+{
+	// Only the centered part of the targets that was rendered to is shown, see SetEyeViewportSize
+	vr::VRTextureBounds_t bounds[2];
+	if ( m_bMonoFrame )
+	{
+		// Each eye sees its part of the mono image
+		const float fBorderU = 0.5f * (float)( m_nMonoTargetWidth - m_nMonoViewportWidth ) / (float)m_nMonoTargetWidth;
+		const float fBorderV = 0.5f * (float)( m_nMonoTargetHeight - m_nMonoViewportHeight ) / (float)m_nMonoTargetHeight;
+		for ( int nEyeIndex = 0; nEyeIndex < 2; ++nEyeIndex )
+		{
+			const vr::VRTextureBounds_t &eyeBounds = m_monoEyeBounds[nEyeIndex];
+			bounds[nEyeIndex].uMin = fBorderU + eyeBounds.uMin * ( 1.0f - 2.0f * fBorderU );
+			bounds[nEyeIndex].uMax = fBorderU + eyeBounds.uMax * ( 1.0f - 2.0f * fBorderU );
+			bounds[nEyeIndex].vMin = fBorderV + eyeBounds.vMin * ( 1.0f - 2.0f * fBorderV );
+			bounds[nEyeIndex].vMax = fBorderV + eyeBounds.vMax * ( 1.0f - 2.0f * fBorderV );
+		}
+	}
+	else
+	{
+		const float fBorderU = 0.5f * (float)( m_nEyeTargetWidth - m_nEyeViewportWidth ) / (float)m_nEyeTargetWidth;
+		const float fBorderV = 0.5f * (float)( m_nEyeTargetHeight - m_nEyeViewportHeight ) / (float)m_nEyeTargetHeight;
+		bounds[0] = { fBorderU, fBorderV, 1.0f - fBorderU, 1.0f - fBorderV };
+		bounds[1] = bounds[0];
+	}
+	const vr::EVRSubmitFlags eFlags = m_latchedHMDPose.bPoseIsValid ? vr::Submit_TextureWithPose : vr::Submit_Default;
+
+	vr::VRTextureWithPose_t leftEyeTexture;
+	leftEyeTexture.handle = (void*)(uintptr_t)( m_bMonoFrame ? monoEyeDesc : leftEyeDesc ).m_nResolveTextureId;
+	leftEyeTexture.eType = vr::TextureType_OpenGL;
+	leftEyeTexture.eColorSpace = vr::ColorSpace_Gamma;
+	leftEyeTexture.mDeviceToAbsoluteTracking = m_latchedHMDPose.mDeviceToAbsoluteTracking;
+	vr::VRCompositor()->Submit( vr::Eye_Left, &leftEyeTexture, &bounds[0], eFlags );
+
+	vr::VRTextureWithPose_t rightEyeTexture = leftEyeTexture;
+	rightEyeTexture.handle = (void*)(uintptr_t)( m_bMonoFrame ? monoEyeDesc : rightEyeDesc ).m_nResolveTextureId;
+	vr::VRCompositor()->Submit( vr::Eye_Right, &rightEyeTexture, &bounds[1], eFlags );
+
+	if ( pose_latch_time != 0 )
+	{
+		const Uint64 nNow = SDL_GetPerformanceCounter();
+		const double fTicksPerMs = (double)SDL_GetPerformanceFrequency() * 0.001;
+		const double fLatchMs = (double)( nNow - pose_latch_time ) / fTicksPerMs;
+		const double fWaitMs = (double)( nNow - pose_wait_time ) / fTicksPerMs;
+		pose_to_submit_ms = pose_to_submit_ms == 0.0 ? fLatchMs : pose_to_submit_ms * 0.9 + fLatchMs * 0.1;
+		pose_wait_to_submit_ms = pose_wait_to_submit_ms == 0.0 ? fWaitMs : pose_wait_to_submit_ms * 0.9 + fWaitMs * 0.1;
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Converts a SteamVR matrix to our local matrix class
 //-----------------------------------------------------------------------------
@@ -3230,6 +5215,7 @@ int main(int argc, char *argv[])
 	if (!pMainApplication->BInit())
 	{
 		pMainApplication->Shutdown();
+		pMainApplication->state_writer.stop();
 		return 1;
 	}
 
@@ -3238,6 +5224,8 @@ int main(int argc, char *argv[])
 
 	if(pMainApplication->exit_code == 0)
 		pMainApplication->save_config();
+	// Writes whatever is still queued
+	pMainApplication->state_writer.stop();
 
 	return pMainApplication->exit_code;
 }
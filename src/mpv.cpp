@@ -5,8 +5,39 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
+#include <dlfcn.h>
 #include <sys/wait.h>
 
+// libmpv is loaded with dlopen the first time it's needed, so that window capture doesn't pay for loading
+// libmpv and all of its dependencies. The mpv headers are only used for types and declarations
+#define LIBMPV_FUNCTIONS(X) \
+    X(mpv_create) \
+    X(mpv_initialize) \
+    X(mpv_destroy) \
+    X(mpv_set_option_string) \
+    X(mpv_command_async) \
+    X(mpv_get_property) \
+    X(mpv_set_property_async) \
+    X(mpv_observe_property) \
+    X(mpv_wait_event) \
+    X(mpv_error_string) \
+    X(mpv_set_wakeup_callback) \
+    X(mpv_render_context_create) \
+    X(mpv_render_context_free) \
+    X(mpv_render_context_set_update_callback) \
+    X(mpv_render_context_update) \
+    X(mpv_render_context_render) \
+    X(mpv_render_context_report_swap)
+
+struct LibMpv {
+    void *handle = nullptr;
+#define X(func) decltype(&::func) func = nullptr;
+    LIBMPV_FUNCTIONS(X)
+#undef X
+};
+
+static LibMpv libmpv;
+
 static bool exec_program_daemonized(const char **args) {
     /* 1 argument */
     if(args[0] == nullptr)
@@ -64,30 +95,103 @@ Mpv::~Mpv() {
     destroy();
 }
 
+bool Mpv::load_library() {
+    if(libmpv.handle)
+        return true;
+
+    const char *library_names[] = { "libmpv.so.2", "libmpv.so.1", "libmpv.so" };
+    void *handle = nullptr;
+    for(const char *library_name : library_names) {
+        handle = dlopen(library_name, RTLD_NOW | RTLD_LOCAL);
+        if(handle)
+            break;
+    }
+
+    if(!handle) {
+        fprintf(stderr, "Error: Failed to load libmpv, make sure mpv is installed: %s\n", dlerror());
+        return false;
+    }
+
+#define X(func) \
+    libmpv.func = (decltype(&::func))dlsym(handle, #func); \
+    if(!libmpv.func) { \
+        fprintf(stderr, "Error: libmpv is missing the function %s, your version of mpv is too old\n", #func); \
+        dlclose(handle); \
+        libmpv = LibMpv(); \
+        return false; \
+    }
+    LIBMPV_FUNCTIONS(X)
+#undef X
+
+    libmpv.handle = handle;
+    return true;
+}
+
 bool Mpv::create(bool use_system_mpv_config, const char *profile) {
     if(created)
         return false;
 
-    mpv = mpv_create();
+    if(!load_library())
+        return false;
+
+    mpv = libmpv.mpv_create();
     if(!mpv) {
         fprintf(stderr, "Error: mpv_create failed\n");
         return false;
     }
 
     if(use_system_mpv_config) {
-        mpv_set_option_string(mpv, "config", "yes");
-        mpv_set_option_string(mpv, "load-scripts", "yes");
+        libmpv.mpv_set_option_string(mpv, "config", "yes");
+        libmpv.mpv_set_option_string(mpv, "load-scripts", "yes");
     }
 
-    if(mpv_initialize(mpv) < 0) {
+    if(libmpv.mpv_initialize(mpv) < 0) {
         fprintf(stderr, "Error: mpv_initialize failed\n");
-        mpv_destroy(mpv);
+        libmpv.mpv_destroy(mpv);
         mpv = nullptr;
         return false;
     }
 
     //mpv_request_log_messages(mpv, "debug");
 
+    //libmpv.mpv_set_option_string(mpv, "vd-lavc-dr", "yes");
+    libmpv.mpv_set_option_string(mpv, "hwdec", "auto");
+    libmpv.mpv_set_option_string(mpv, "profile", profile);
+    libmpv.mpv_set_option_string(mpv, "gpu-api", "opengl");
+    // This has to be set after libmpv.mpv_set_option_string(... "profile") since that option overwrites this
+    libmpv.mpv_set_option_string(mpv, "vo", "libmpv");
+    // Opens the next playlist entry while the current one is still playing, so switching to it doesn't wait for the demuxer
+    libmpv.mpv_set_option_string(mpv, "prefetch-playlist", "yes");
+    // mpv goes idle when the playlist has ended, which is when the program quits
+    libmpv.mpv_observe_property(mpv, 0, "idle-active", MPV_FORMAT_FLAG);
+    // Reading these with mpv_get_property would wait for the mpv core, which can be busy for a while (loadfile)
+    libmpv.mpv_observe_property(mpv, 0, "frame-drop-count", MPV_FORMAT_INT64);
+    libmpv.mpv_observe_property(mpv, 0, "decoder-frame-drop-count", MPV_FORMAT_INT64);
+    libmpv.mpv_observe_property(mpv, 0, "vo-delayed-frame-count", MPV_FORMAT_INT64);
+    libmpv.mpv_observe_property(mpv, 0, "mistimed-frame-count", MPV_FORMAT_INT64);
+
+    wakeup_on_mpv_render_update = SDL_RegisterEvents(1);
+    wakeup_on_mpv_events = SDL_RegisterEvents(1);
+    if(wakeup_on_mpv_render_update == (uint32_t)-1 || wakeup_on_mpv_events == (uint32_t)-1) {
+        fprintf(stderr, "Error: SDL_RegisterEvents failed\n");
+        // TODO: Remove registered events?
+        wakeup_on_mpv_render_update = -1;
+        wakeup_on_mpv_events = -1;
+        libmpv.mpv_destroy(mpv);
+        mpv = nullptr;
+        return false;
+    }
+
+    libmpv.mpv_set_wakeup_callback(mpv, on_mpv_events, this);
+
+    created = true;
+    return true;
+}
+
+bool Mpv::create_render_context() {
+    if(!created || mpv_gl)
+        return false;
+
     mpv_opengl_init_params gl_init_params;
     memset(&gl_init_params, 0, sizeof(gl_init_params));
     gl_init_params.get_proc_address = get_proc_address_mpv;
@@ -98,44 +202,38 @@ bool Mpv::create(bool use_system_mpv_config, const char *profile) {
         { MPV_RENDER_PARAM_API_TYPE, (void*)MPV_RENDER_API_TYPE_OPENGL },
         { MPV_RENDER_PARAM_OPENGL_INIT_PARAMS, &gl_init_params },
         { MPV_RENDER_PARAM_ADVANCED_CONTROL, &advanced_control },
-        //{ MPV_RENDER_PARAM_BLOCK_FOR_TARGET_TIME, 0 }, // TODO: Manually sync after this
         { MPV_RENDER_PARAM_INVALID, 0 }
     };
 
-    //mpv_set_option_string(mpv, "vd-lavc-dr", "yes");
-    mpv_set_option_string(mpv, "hwdec", "auto");
-    mpv_set_option_string(mpv, "profile", profile);
-    mpv_set_option_string(mpv, "gpu-api", "opengl");
-    // This has to be set after mpv_set_option_string(... "profile") since that option overwrites this
-    mpv_set_option_string(mpv, "vo", "libmpv");
-
-    if(mpv_render_context_create(&mpv_gl, mpv, params) < 0) {
+    if(libmpv.mpv_render_context_create(&mpv_gl, mpv, params) < 0) {
         fprintf(stderr, "Error: mpv_render_context_create failed\n");
-        mpv_destroy(mpv);
-        mpv = nullptr;
         mpv_gl = nullptr;
         return false;
     }
 
-    wakeup_on_mpv_render_update = SDL_RegisterEvents(1);
-    wakeup_on_mpv_events = SDL_RegisterEvents(1);
-    if(wakeup_on_mpv_render_update == (uint32_t)-1 || wakeup_on_mpv_events == (uint32_t)-1) {
-        fprintf(stderr, "Error: SDL_RegisterEvents failed\n");
-        // TODO: Remove registered events?
-        wakeup_on_mpv_render_update = -1;
-        wakeup_on_mpv_events = -1;
-        mpv_render_context_free(mpv_gl);
-        mpv_destroy(mpv);
-        mpv = nullptr;
-        mpv_gl = nullptr;
-        return false;
-    }
+    libmpv.mpv_render_context_set_update_callback(mpv_gl, on_mpv_render_update, this);
+    return true;
+}
 
-    mpv_set_wakeup_callback(mpv, on_mpv_events, this);
-    mpv_render_context_set_update_callback(mpv_gl, on_mpv_render_update, this);
+void Mpv::set_display_fps(double display_fps) {
+    if(!created || display_fps <= 0.0)
+        return;
 
-    created = true;
-    return true;
+    char display_fps_str[64];
+    snprintf(display_fps_str, sizeof(display_fps_str), "%f", display_fps);
+    // The option was renamed in mpv 0.37
+    if(libmpv.mpv_set_option_string(mpv, "display-fps-override", display_fps_str) < 0)
+        libmpv.mpv_set_option_string(mpv, "override-display-fps", display_fps_str);
+    libmpv.mpv_set_option_string(mpv, "video-sync", "display-resample");
+    this->display_fps = display_fps;
+}
+
+void Mpv::set_display_sync(bool enabled) {
+    if(!created || display_fps <= 0.0)
+        return;
+
+    const char *video_sync = enabled ? "display-resample" : "audio";
+    libmpv.mpv_set_property_async(mpv, 0, "video-sync", MPV_FORMAT_STRING, &video_sync);
 }
 
 bool Mpv::destroy() {
@@ -143,20 +241,22 @@ bool Mpv::destroy() {
         return true;
 
     if(mpv_gl)
-        mpv_render_context_free(mpv_gl);
+        libmpv.mpv_render_context_free(mpv_gl);
     if(mpv)
-        mpv_destroy(mpv);
+        libmpv.mpv_destroy(mpv);
 
+    mpv_gl = nullptr;
+    mpv = nullptr;
     created = false;
     return true;
 }
 
-bool Mpv::load_file(const char *path) {
+bool Mpv::load_file(const char *path, bool append) {
     if(!created)
         return false;
 
-    const char *cmd[] = { "loadfile", path, nullptr };
-    mpv_command_async(mpv, 0, cmd);
+    const char *cmd[] = { "loadfile", path, append ? "append" : "replace", nullptr };
+    libmpv.mpv_command_async(mpv, 0, cmd);
     return true;
 }
 
@@ -180,7 +280,7 @@ void Mpv::on_event(SDL_Event &event, bool *render_update, int64_t *width, int64_
         return;
 
     if(event.type == wakeup_on_mpv_render_update) {
-        uint64_t flags = mpv_render_context_update(mpv_gl);
+        uint64_t flags = libmpv.mpv_render_context_update(mpv_gl);
         if(flags & MPV_RENDER_UPDATE_FRAME) {
             if(render_update)
                 *render_update = true;
@@ -189,7 +289,7 @@ void Mpv::on_event(SDL_Event &event, bool *render_update, int64_t *width, int64_
 
     if(event.type == wakeup_on_mpv_events) {
         while(true) {
-            mpv_event *mp_event = mpv_wait_event(mpv, 0);
+            mpv_event *mp_event = libmpv.mpv_wait_event(mpv, 0);
             if(mp_event->event_id == MPV_EVENT_NONE)
                 break;
             
@@ -200,28 +300,51 @@ void Mpv::on_event(SDL_Event &event, bool *render_update, int64_t *width, int64_
                 //printf("mpv event: %s\n", mpv_event_name(mp_event->event_id));
             }
 
+            if(mp_event->event_id == MPV_EVENT_START_FILE) {
+                file_started = true;
+                end_file_error = 0;
+            }
+
+            // mpv moves on to the next playlist entry by itself, the program only quits once there is nothing left to play
             if(mp_event->event_id == MPV_EVENT_END_FILE) {
                 mpv_event_end_file *msg = (mpv_event_end_file*)mp_event->data;
                 if(msg->reason == MPV_END_FILE_REASON_ERROR) {
-                    show_notification("vr video player mpv video error", mpv_error_string(msg->error), "critical");
+                    show_notification("vr video player mpv video error", libmpv.mpv_error_string(msg->error), "critical");
+                    end_file_error = -1;
+                }
+            }
+
+            if(mp_event->event_id == MPV_EVENT_PROPERTY_CHANGE) {
+                mpv_event_property *property = (mpv_event_property*)mp_event->data;
+                // mpv is also idle before the first file has started
+                if(strcmp(property->name, "idle-active") == 0 && property->format == MPV_FORMAT_FLAG && *(int*)property->data && file_started) {
+                    if(end_file_error == 0)
+                        show_notification("vr video player", "the video ended", "low");
                     if(quit) {
                         *quit = true;
-                        *error = -1;
+                        *error = end_file_error;
                     }
                 }
-                if(msg->reason == MPV_END_FILE_REASON_EOF) {
-                    show_notification("vr video player", "the video ended", "low");
-                    if(quit)
-                        *quit = true;
+
+                if(property->format == MPV_FORMAT_INT64) {
+                    const int64_t value = *(int64_t*)property->data;
+                    if(strcmp(property->name, "frame-drop-count") == 0)
+                        frame_stats.dropped = value;
+                    else if(strcmp(property->name, "decoder-frame-drop-count") == 0)
+                        frame_stats.decoder_dropped = value;
+                    else if(strcmp(property->name, "vo-delayed-frame-count") == 0)
+                        frame_stats.delayed = value;
+                    else if(strcmp(property->name, "mistimed-frame-count") == 0)
+                        frame_stats.mistimed = value;
                 }
             }
 
             if(mp_event->event_id == MPV_EVENT_VIDEO_RECONFIG) {
                 int64_t new_width = 0;
-                mpv_get_property(mpv, "width", MPV_FORMAT_INT64, &new_width);
+                libmpv.mpv_get_property(mpv, "width", MPV_FORMAT_INT64, &new_width);
 
                 int64_t new_height = 0;
-                mpv_get_property(mpv, "height", MPV_FORMAT_INT64, &new_height);
+                libmpv.mpv_get_property(mpv, "height", MPV_FORMAT_INT64, &new_height);
                 
                 if(width)
                     *width = new_width;
@@ -241,7 +364,7 @@ void Mpv::seek(double seconds) {
     snprintf(seconds_str, sizeof(seconds_str), "%f", seconds);
 
     const char *cmd[] = { "seek", seconds_str, nullptr };
-    mpv_command_async(mpv, 0, cmd);
+    libmpv.mpv_command_async(mpv, 0, cmd);
 }
 
 void Mpv::toggle_pause() {
@@ -250,10 +373,10 @@ void Mpv::toggle_pause() {
 
     paused = !paused;
     int pause_value = paused ? 1 : 0;
-    mpv_set_property_async(mpv, 0, "pause", MPV_FORMAT_FLAG, &pause_value);
+    libmpv.mpv_set_property_async(mpv, 0, "pause", MPV_FORMAT_FLAG, &pause_value);
 }
 
-void Mpv::draw(unsigned int framebuffer_id, int width, int height) {
+void Mpv::draw(unsigned int framebuffer_id, int width, int height, bool skip_rendering) {
     if(!created)
         return;
 
@@ -264,15 +387,28 @@ void Mpv::draw(unsigned int framebuffer_id, int width, int height) {
     fbo.h = height;
 
     int flip_y = 0;
-    int shit = 1;
+    int block_for_target_time = 0;
+    int skip = skip_rendering ? 1 : 0;
 
     mpv_render_param params[] = {
         { MPV_RENDER_PARAM_OPENGL_FBO, &fbo },
         { MPV_RENDER_PARAM_FLIP_Y, &flip_y },
-        //{ MPV_RENDER_PARAM_SKIP_RENDERING, &shit },
+        { MPV_RENDER_PARAM_BLOCK_FOR_TARGET_TIME, &block_for_target_time },
+        { MPV_RENDER_PARAM_SKIP_RENDERING, &skip },
         { MPV_RENDER_PARAM_INVALID, 0 }
     };
 
-    int res = mpv_render_context_render(mpv_gl, params);
+    int res = libmpv.mpv_render_context_render(mpv_gl, params);
     //fprintf(stderr, "draw mpv: %d\n", res);
+}
+
+void Mpv::report_swap() {
+    if(!created)
+        return;
+
+    libmpv.mpv_render_context_report_swap(mpv_gl);
+}
+
+const MpvFrameStats& Mpv::get_frame_stats() const {
+    return frame_stats;
 }
\ No newline at end of file
@@ -0,0 +1,153 @@
+#include "../include/placement_profiles.hpp"
+#include "../include/state_writer.hpp"
+#include "../include/config.hpp"
+#include <fnmatch.h>
+
+// The file is compacted when it has more lines than this plus twice the number of profiles
+#define PROFILES_COMPACT_SLACK 64
+
+static bool has_wildcards(const std::string &pattern) {
+    for(size_t i = 0; i < pattern.size(); ++i) {
+        if(pattern[i] == '\\')
+            ++i;
+        else if(pattern[i] == '*' || pattern[i] == '?' || pattern[i] == '[')
+            return true;
+    }
+    return false;
+}
+
+// A WM_CLASS as a pattern that only matches itself
+static std::string escape_pattern(const std::string &str) {
+    std::string pattern;
+    for(char c : str) {
+        if(c == '*' || c == '?' || c == '[' || c == '\\')
+            pattern += '\\';
+        // Tabs and newlines separate the fields and lines of the file
+        pattern += (c == '\t' || c == '\n') ? ' ' : c;
+    }
+    return pattern;
+}
+
+static std::string profile_to_line(const std::string &key, const PlacementProfile &profile) {
+    setlocale(LC_ALL, "C");
+
+    std::string line = key;
+    string_append_format(line, "\t%f|%f|%f", profile.position.x, profile.position.y, profile.position.z);
+    string_append_format(line, "\t%f|%f|%f|%f", profile.rotation.x, profile.rotation.y, profile.rotation.z, profile.rotation.w);
+    string_append_format(line, "\t%f", profile.zoom);
+    return line;
+}
+
+bool PlacementProfiles::add_line(const std::string &line) {
+    std::vector<std::string> fields;
+    string_split_char(line, '\t', [&](StringView field) {
+        fields.emplace_back(field.str, field.size);
+        return true;
+    });
+
+    if(fields.size() != 6 || (fields[1] != "class" && fields[1] != "title") || fields[2].empty())
+        return false;
+
+    const StringView key_name = { line.data(), line.size() };
+    PlacementProfile profile;
+    if(!string_to_vec3(fields[3], profile.position, key_name) || !string_to_quat(fields[4], profile.rotation, key_name) || !string_to_float(fields[5], profile.zoom, key_name))
+        return false;
+
+    const std::string key = fields[0] + '\t' + fields[1] + '\t' + fields[2];
+    auto it = profiles.find(key);
+    if(it != profiles.end()) {
+        it->second = profile;
+        return true;
+    }
+    profiles[key] = profile;
+    keys.push_back(key);
+
+    if(fields[1] == "title")
+        title_patterns.push_back({ fields[0], fields[2], key });
+    else if(has_wildcards(fields[2]))
+        class_patterns.push_back({ fields[0], fields[2], key });
+    return true;
+}
+
+void PlacementProfiles::load(const std::string &path, StateWriter &state_writer) {
+    setlocale(LC_ALL, "C");
+
+    this->path = path;
+    profiles.clear();
+    keys.clear();
+    title_patterns.clear();
+    class_patterns.clear();
+
+    std::string file_content;
+    if(!file_get_content(path.c_str(), file_content))
+        return;
+
+    size_t num_lines = 0;
+    string_split_char(file_content, '\n', [&](StringView line) {
+        ++num_lines;
+        if(line.size > 0 && !add_line(std::string(line.str, line.size)))
+            fprintf(stderr, "Warning: Invalid placement profile: %.*s\n", (int)line.size, line.str);
+        return true;
+    });
+
+    // A crash while appending can leave an incomplete last line, the next append would continue it
+    const bool incomplete_line = !file_content.empty() && file_content.back() != '\n';
+    if(!incomplete_line && num_lines <= profiles.size() * 2 + PROFILES_COMPACT_SLACK)
+        return;
+
+    std::string content;
+    for(const std::string &key : keys) {
+        content += profile_to_line(key, profiles[key]);
+        content += '\n';
+    }
+    state_writer.write(path, std::move(content));
+}
+
+const PlacementProfile* PlacementProfiles::find(const char *mode, const std::string &wm_class, const std::string &title, std::string &match) const {
+    match.clear();
+
+    for(const Pattern &pattern : title_patterns) {
+        if(pattern.mode == mode && fnmatch(pattern.pattern.c_str(), title.c_str(), 0) == 0) {
+            match = "title\t" + pattern.pattern;
+            return &profiles.find(pattern.key)->second;
+        }
+    }
+
+    if(wm_class.empty())
+        return nullptr;
+
+    match = "class\t" + escape_pattern(wm_class);
+    auto it = profiles.find(std::string(mode) + '\t' + match);
+    if(it != profiles.end())
+        return &it->second;
+
+    for(const Pattern &pattern : class_patterns) {
+        if(pattern.mode == mode && fnmatch(pattern.pattern.c_str(), wm_class.c_str(), 0) == 0) {
+            match = "class\t" + pattern.pattern;
+            return &profiles.find(pattern.key)->second;
+        }
+    }
+
+    return nullptr;
+}
+
+void PlacementProfiles::save(const char *mode, const std::string &match, PlacementProfile profile, bool save_position, StateWriter &state_writer) {
+    if(match.empty() || path.empty())
+        return;
+
+    const std::string key = std::string(mode) + '\t' + match;
+    auto it = profiles.find(key);
+    if(!save_position)
+        profile.position = it != profiles.end() ? it->second.position : glm::vec3(0.0f, 0.0f, 0.0f);
+
+    if(it == profiles.end()) {
+        profiles[key] = profile;
+        keys.push_back(key);
+    } else if(it->second.position != profile.position || it->second.rotation != profile.rotation || it->second.zoom != profile.zoom) {
+        it->second = profile;
+    } else {
+        return;
+    }
+
+    state_writer.append(path, key, profile_to_line(key, profile));
+}
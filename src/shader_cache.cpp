@@ -0,0 +1,210 @@
+#include "../include/shader_cache.hpp"
+#include <GL/glew.h>
+#include <SDL.h>
+#include <stdio.h>
+#include <string.h>
+
+#define CACHE_FILE_MAGIC "VRVPSHC1"
+
+struct CacheFileHeader {
+    char magic[8];
+    uint64_t key;
+    uint32_t binary_format;
+    uint32_t binary_size;
+};
+
+typedef void (APIENTRY *MaxShaderCompilerThreadsProc)(GLuint count);
+
+// FNV-1a
+static uint64_t hash_append(uint64_t hash, const char *str) {
+    if(!str)
+        str = "";
+
+    for(; *str; ++str) {
+        hash ^= (unsigned char)*str;
+        hash *= 0x100000001b3ULL;
+    }
+    // Separate the strings so that moving characters between them changes the hash
+    hash ^= 0xff;
+    hash *= 0x100000001b3ULL;
+    return hash;
+}
+
+static const uint64_t hash_initial = 0xcbf29ce484222325ULL;
+
+void ShaderCache::init(const std::string &directory) {
+    this->directory = directory;
+
+    driver_key = hash_initial;
+    driver_key = hash_append(driver_key, (const char*)glGetString(GL_VENDOR));
+    driver_key = hash_append(driver_key, (const char*)glGetString(GL_RENDERER));
+    driver_key = hash_append(driver_key, (const char*)glGetString(GL_VERSION));
+
+    GLint num_binary_formats = 0;
+    if(GLEW_ARB_get_program_binary)
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_binary_formats);
+    binaries_supported = num_binary_formats > 0;
+
+    // Lets the driver compile the programs on multiple threads instead of one after another
+    MaxShaderCompilerThreadsProc max_shader_compiler_threads = nullptr;
+    if(SDL_GL_ExtensionSupported("GL_KHR_parallel_shader_compile"))
+        max_shader_compiler_threads = (MaxShaderCompilerThreadsProc)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsKHR");
+    else if(SDL_GL_ExtensionSupported("GL_ARB_parallel_shader_compile"))
+        max_shader_compiler_threads = (MaxShaderCompilerThreadsProc)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsARB");
+
+    if(max_shader_compiler_threads)
+        max_shader_compiler_threads(0xFFFFFFFF);
+}
+
+std::string ShaderCache::get_cache_file_path(const std::string &name) const {
+    return directory + "/" + name + ".bin";
+}
+
+bool ShaderCache::load_program_binary(const std::string &name, uint64_t key, unsigned int program_id) {
+    if(!binaries_supported || directory.empty())
+        return false;
+
+    FILE *file = fopen(get_cache_file_path(name).c_str(), "rb");
+    if(!file)
+        return false;
+
+    bool success = false;
+    CacheFileHeader header;
+    if(fread(&header, 1, sizeof(header), file) == sizeof(header)
+        && memcmp(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic)) == 0
+        && header.key == key)
+    {
+        std::vector<char> binary(header.binary_size);
+        if(fread(binary.data(), 1, binary.size(), file) == binary.size()) {
+            glProgramBinary(program_id, header.binary_format, binary.data(), binary.size());
+            // The driver can still reject the binary, for example after an update that didn't change the version string
+            GLint link_status = GL_FALSE;
+            glGetProgramiv(program_id, GL_LINK_STATUS, &link_status);
+            success = link_status == GL_TRUE;
+        }
+    }
+
+    fclose(file);
+    return success;
+}
+
+void ShaderCache::save_program_binary(const std::string &name, uint64_t key, unsigned int program_id) {
+    if(!binaries_supported || directory.empty())
+        return;
+
+    GLint binary_size = 0;
+    glGetProgramiv(program_id, GL_PROGRAM_BINARY_LENGTH, &binary_size);
+    if(binary_size <= 0)
+        return;
+
+    std::vector<char> binary(binary_size);
+    CacheFileHeader header;
+    memcpy(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic));
+    header.key = key;
+    GLsizei written_size = 0;
+    GLenum binary_format = 0;
+    glGetProgramBinary(program_id, binary_size, &written_size, &binary_format, binary.data());
+    if(written_size <= 0)
+        return;
+    header.binary_format = binary_format;
+    header.binary_size = written_size;
+
+    // Written to a temporary file first so that a partially written cache file is never loaded
+    const std::string cache_file_path = get_cache_file_path(name);
+    const std::string tmp_file_path = cache_file_path + ".tmp";
+    FILE *file = fopen(tmp_file_path.c_str(), "wb");
+    if(!file) {
+        fprintf(stderr, "Warning: Failed to create shader cache file: %s\n", tmp_file_path.c_str());
+        return;
+    }
+
+    bool success = fwrite(&header, 1, sizeof(header), file) == sizeof(header)
+        && fwrite(binary.data(), 1, written_size, file) == (size_t)written_size;
+    success = fclose(file) == 0 && success;
+
+    if(!success || rename(tmp_file_path.c_str(), cache_file_path.c_str()) != 0) {
+        fprintf(stderr, "Warning: Failed to write shader cache file: %s\n", cache_file_path.c_str());
+        remove(tmp_file_path.c_str());
+    }
+}
+
+static GLuint start_compile_shader(GLenum type, const char *source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    return shader;
+}
+
+static bool check_shader_compiled(const char *name, const char *type_name, GLuint shader) {
+    GLint compiled = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if(compiled == GL_TRUE)
+        return true;
+
+    char info_log[1024];
+    info_log[0] = '\0';
+    glGetShaderInfoLog(shader, sizeof(info_log), NULL, info_log);
+    fprintf(stderr, "%s - Unable to compile %s shader %u: %s\n", name, type_name, shader, info_log);
+    return false;
+}
+
+void ShaderCache::add_program(const char *name, const char *vertex_shader, const char *fragment_shader, unsigned int &program_id) {
+    uint64_t key = driver_key;
+    key = hash_append(key, name);
+    key = hash_append(key, vertex_shader);
+    key = hash_append(key, fragment_shader);
+
+    program_id = glCreateProgram();
+    if(load_program_binary(name, key, program_id))
+        return;
+
+    // Status isn't queried until |finish_programs| since that would wait for the compiler
+    PendingProgram program;
+    program.name = name;
+    program.key = key;
+    program.program_id = &program_id;
+    program.vertex_shader = start_compile_shader(GL_VERTEX_SHADER, vertex_shader);
+    program.fragment_shader = start_compile_shader(GL_FRAGMENT_SHADER, fragment_shader);
+
+    glAttachShader(program_id, program.vertex_shader);
+    glAttachShader(program_id, program.fragment_shader);
+    if(binaries_supported)
+        glProgramParameteri(program_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program_id);
+
+    pending_programs.push_back(std::move(program));
+}
+
+bool ShaderCache::finish_programs() {
+    bool success = true;
+    for(PendingProgram &program : pending_programs) {
+        GLuint program_id = *program.program_id;
+
+        GLint link_status = GL_FALSE;
+        glGetProgramiv(program_id, GL_LINK_STATUS, &link_status);
+        if(link_status != GL_TRUE) {
+            // Only check the shaders once linking failed, the link status already covers them
+            if(check_shader_compiled(program.name.c_str(), "vertex", program.vertex_shader)
+                && check_shader_compiled(program.name.c_str(), "fragment", program.fragment_shader))
+            {
+                fprintf(stderr, "%s - Error linking program %u!\n", program.name.c_str(), program_id);
+            }
+        }
+
+        // The program hangs onto the shaders until it's deleted otherwise
+        glDetachShader(program_id, program.vertex_shader);
+        glDetachShader(program_id, program.fragment_shader);
+        glDeleteShader(program.vertex_shader);
+        glDeleteShader(program.fragment_shader);
+
+        if(link_status == GL_TRUE) {
+            save_program_binary(program.name, program.key, program_id);
+        } else {
+            glDeleteProgram(program_id);
+            *program.program_id = 0;
+            success = false;
+        }
+    }
+    pending_programs.clear();
+    return success;
+}
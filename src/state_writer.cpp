@@ -0,0 +1,165 @@
+#include "../include/state_writer.hpp"
+#include "../include/config.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+// How long to wait after a change for more changes before writing
+#define STATE_WRITE_DELAY_MS 250
+// Changes that keep coming in (a key that is held down) still get written at least this often
+#define STATE_WRITE_MAX_DELAY_MS 2000
+
+StateWriter::~StateWriter() {
+    stop();
+}
+
+void StateWriter::start() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(running)
+        return;
+
+    running = true;
+    thread = std::thread([this]{ thread_loop(); });
+}
+
+void StateWriter::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+        condition.notify_one();
+    }
+
+    if(thread.joinable())
+        thread.join();
+}
+
+void StateWriter::write(const std::string &path, std::string content) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if(!running) {
+        lock.unlock();
+        write_file(path, content);
+        return;
+    }
+
+    pending_writes[path] = std::move(content);
+    last_change_time = std::chrono::steady_clock::now();
+    condition.notify_one();
+}
+
+void StateWriter::append(const std::string &path, const std::string &key, std::string line) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if(!running) {
+        lock.unlock();
+        append_file(path, { { key, std::move(line) } });
+        return;
+    }
+
+    pending_appends[path][key] = std::move(line);
+    last_change_time = std::chrono::steady_clock::now();
+    condition.notify_one();
+}
+
+void StateWriter::thread_loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for(;;) {
+        condition.wait(lock, [this]{ return !running || !pending_writes.empty() || !pending_appends.empty(); });
+
+        // Every change that comes in meanwhile replaces the content that was queued and pushes the write back,
+        // so holding a key only writes once it's released. Stopping writes right away
+        const auto max_write_time = std::chrono::steady_clock::now() + std::chrono::milliseconds(STATE_WRITE_MAX_DELAY_MS);
+        while(running) {
+            const auto write_time = std::min(last_change_time + std::chrono::milliseconds(STATE_WRITE_DELAY_MS), max_write_time);
+            if(std::chrono::steady_clock::now() >= write_time)
+                break;
+            condition.wait_until(lock, write_time);
+        }
+
+        std::map<std::string, std::string> writes;
+        writes.swap(pending_writes);
+        std::map<std::string, std::map<std::string, std::string>> appends;
+        appends.swap(pending_appends);
+        const bool stopping = !running;
+
+        lock.unlock();
+        for(const auto &it : writes) {
+            write_file(it.first, it.second);
+        }
+        for(const auto &it : appends) {
+            append_file(it.first, it.second);
+        }
+        lock.lock();
+
+        if(stopping && pending_writes.empty() && pending_appends.empty())
+            break;
+    }
+}
+
+void StateWriter::write_file(const std::string &path, const std::string &content) {
+    char dir_tmp[PATH_MAX];
+    snprintf(dir_tmp, sizeof(dir_tmp), "%s", path.c_str());
+    char *dir = dirname(dir_tmp);
+    if(create_directory_recursive(dir) != 0) {
+        fprintf(stderr, "Warning: Failed to create directory: %s\n", dir);
+        return;
+    }
+
+    // A new file with a unique name, so that nothing (a symlink for example) that is already at the path gets written through
+    std::string tmp_path = path + ".XXXXXX";
+    int fd = mkstemp(&tmp_path[0]);
+    if(fd == -1) {
+        fprintf(stderr, "Warning: Failed to create file: %s\n", tmp_path.c_str());
+        return;
+    }
+    fchmod(fd, 0644);
+
+    FILE *file = fdopen(fd, "wb");
+    if(!file) {
+        fprintf(stderr, "Warning: Failed to create file: %s\n", tmp_path.c_str());
+        close(fd);
+        remove(tmp_path.c_str());
+        return;
+    }
+
+    bool success = fwrite(content.data(), 1, content.size(), file) == content.size();
+    success = fflush(file) == 0 && success;
+    // The content has to be on disk before the rename, otherwise a crash can leave an empty file behind the new name
+    success = fsync(fileno(file)) == 0 && success;
+    success = fclose(file) == 0 && success;
+
+    if(!success || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        fprintf(stderr, "Warning: Failed to write file: %s\n", path.c_str());
+        remove(tmp_path.c_str());
+    }
+}
+
+void StateWriter::append_file(const std::string &path, const std::map<std::string, std::string> &lines) {
+    char dir_tmp[PATH_MAX];
+    snprintf(dir_tmp, sizeof(dir_tmp), "%s", path.c_str());
+    char *dir = dirname(dir_tmp);
+    if(create_directory_recursive(dir) != 0) {
+        fprintf(stderr, "Warning: Failed to create directory: %s\n", dir);
+        return;
+    }
+
+    std::string content;
+    for(const auto &it : lines) {
+        content += it.second;
+        content += '\n';
+    }
+
+    // All lines go out in a single write so that other writers to the file can't end up in the middle of them
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(fd == -1) {
+        fprintf(stderr, "Warning: Failed to open file: %s\n", path.c_str());
+        return;
+    }
+
+    bool success = ::write(fd, content.data(), content.size()) == (ssize_t)content.size();
+    success = fsync(fd) == 0 && success;
+    success = close(fd) == 0 && success;
+    if(!success)
+        fprintf(stderr, "Warning: Failed to append to file: %s\n", path.c_str());
+}
@@ -1,3 +1,5 @@
+/* glew has to come before the gl headers that window_texture.h includes. It's initialized by main.cpp */
+#include <GL/glew.h>
 #include "../include/window_texture.h"
 #include <X11/extensions/Xcomposite.h>
 #include <stdio.h>
@@ -19,6 +21,13 @@ int window_texture_init(WindowTexture *window_texture, Display *display, Window
     window_texture->pixmap = None;
     window_texture->glx_pixmap = None;
     window_texture->texture_id = 0;
+    window_texture->mipmap_texture_id = 0;
+    window_texture->framebuffers[0] = 0;
+    window_texture->framebuffers[1] = 0;
+    window_texture->width = 0;
+    window_texture->height = 0;
+    window_texture->damage = None;
+    window_texture->damaged = 1;
     window_texture->redirected = 0;
 
     if(!x11_supports_composite_named_window_pixmap(display))
@@ -26,6 +35,12 @@ int window_texture_init(WindowTexture *window_texture, Display *display, Window
 
     XCompositeRedirectWindow(display, window, CompositeRedirectAutomatic);
     window_texture->redirected = 1;
+
+    int damage_event_base;
+    int damage_error_base;
+    if(XDamageQueryExtension(display, &damage_event_base, &damage_error_base))
+        window_texture->damage = XDamageCreate(display, window, XDamageReportNonEmpty);
+
     return window_texture_on_resize(window_texture);
 }
 
@@ -35,6 +50,11 @@ static void window_texture_cleanup(WindowTexture *self, int delete_texture) {
         self->texture_id = 0;
     }
 
+    if(self->mipmap_texture_id) {
+        glDeleteTextures(1, &self->mipmap_texture_id);
+        self->mipmap_texture_id = 0;
+    }
+
     if(self->glx_pixmap) {
         glXDestroyPixmap(self->display, self->glx_pixmap);
         glXReleaseTexImageEXT(self->display, self->glx_pixmap, GLX_FRONT_EXT);
@@ -48,6 +68,17 @@ static void window_texture_cleanup(WindowTexture *self, int delete_texture) {
 }
 
 void window_texture_deinit(WindowTexture *self) {
+    if(self->damage) {
+        XDamageDestroy(self->display, self->damage);
+        self->damage = None;
+    }
+
+    if(self->framebuffers[0]) {
+        glDeleteFramebuffers(2, self->framebuffers);
+        self->framebuffers[0] = 0;
+        self->framebuffers[1] = 0;
+    }
+
     if(self->redirected) {
         XCompositeUnredirectWindow(self->display, self->window, CompositeRedirectAutomatic);
         self->redirected = 0;
@@ -156,13 +187,31 @@ int window_texture_on_resize(WindowTexture *self) {
     glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &fLargest);
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, fLargest);
 
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &self->width);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &self->height);
+
+    glGenTextures(1, &self->mipmap_texture_id);
+    glBindTexture(GL_TEXTURE_2D, self->mipmap_texture_id);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, self->width, self->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, fLargest);
+    /* Allocates the mip levels */
+    glGenerateMipmap(GL_TEXTURE_2D);
+
     glBindTexture(GL_TEXTURE_2D, 0);
 
+    if(self->framebuffers[0] == 0)
+        glGenFramebuffers(2, self->framebuffers);
+
     XFree(configs);
     self->pixmap = pixmap;
     self->glx_pixmap = glx_pixmap;
     if(texture_id != 0)
         self->texture_id = texture_id;
+    self->damaged = 1;
     return 0;
 
     cleanup:
@@ -174,6 +223,32 @@ int window_texture_on_resize(WindowTexture *self) {
     return result;
 }
 
+void window_texture_on_damage(WindowTexture *self) {
+    self->damaged = 1;
+}
+
+void window_texture_update(WindowTexture *self) {
+    if(!self->mipmap_texture_id || (self->damage && !self->damaged))
+        return;
+
+    /* Damage that happens from here on is reported with a new event */
+    if(self->damage)
+        XDamageSubtract(self->display, self->damage, None, None);
+    self->damaged = 0;
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, self->framebuffers[0]);
+    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, self->texture_id, 0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, self->framebuffers[1]);
+    glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, self->mipmap_texture_id, 0);
+    glBlitFramebuffer(0, 0, self->width, self->height, 0, 0, self->width, self->height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+
+    glBindTexture(GL_TEXTURE_2D, self->mipmap_texture_id);
+    glGenerateMipmap(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
 GLuint window_texture_get_opengl_texture_id(WindowTexture *self) {
-    return self->texture_id;
+    return self->mipmap_texture_id;
 }